@@ -1,20 +1,303 @@
+// MAP_ANONYMOUS and MAP_STACK for generator stacks.
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/mman.h>
 
 #include "alisp.h"
 #include "util.h"
 #include "mpc.h"
+#include "vec.h"
+#include "pool.h"
+#include "map.h"
+#include "chan.h"
+#include "reader.h"
+
+#define LVAL_ALLOC() lval_alloc_node()
+
+// Freed nodes a context keeps around for reuse.
+#define LALLOC_KEEP 4096
+
+// Largest function body, in nodes, substituted at call sites.
+#define LVAL_INLINE_MAX 24
+
+// Largest Q-expression, in nodes, a constant call is folded into.
+#define LVAL_FOLD_MAX 64
+
+// Entries kept by 'memo' when no cache size is given.
+#define LMEMO_DEFAULT_CAP 1024
+
+// Tasks 'pmap' splits its list into, per worker thread.
+#define LPMAP_TASKS_PER_WORKER 8
+
+// Concatenations shorter than this are copied, longer ones become ropes.
+#define LSTR_ROPE_MIN 256
+
+// Ropes deeper than this are flattened back into one block.
+#define LSTR_DEPTH_MAX 48
+
+// A lambda whose optimized body goes stale within LOPT_MIN_CALLS calls more
+// than LOPT_RETRIES times in a row settles for running its source.
+#define LOPT_RETRIES 8
+#define LOPT_MIN_CALLS 64
+
+// Stack reserved for each generator. Pages are committed as they're
+// touched, the lowest one is left inaccessible to catch overflows.
+#define LGEN_STACK (1 << 20)
+
+// Optimized function bodies are only valid as long as the symbols they were
+// specialized on keep their bindings. Those symbols are "guarded", each with
+// a version: binding one anywhere gives it a new version and bumps the epoch.
+// Optimized bodies and specialized nodes record the versions of the guards
+// they rely on. A lambda whose body went stale optimizes it again from the
+// source, and only checks its guards at all when the epoch has moved.
+//
+// The variables hold the epoch and guards of whatever the thread is
+// evaluating: contexts, futures and actors keep their own in an lguards and
+// swap them in while they run. Versions and epochs draw from one counter, so
+// a new one is always one that nothing has been stamped with.
+static atomic_ullong lenv_epoch_source = 1;
+static _Thread_local u64 lenv_epoch = 1;
+static _Thread_local u64 lenv_guard_mask = 0;
+static _Thread_local i32 lenv_guard_count = 0;
+static _Thread_local char **lenv_guard_syms = NULL;
+static _Thread_local u64 *lenv_guard_vers = NULL;
+
+// Body being optimized, collecting the guards it relies on.
+static _Thread_local lopt *lenv_guard_into = NULL;
+
+// Kinds of executed S-expression nodes, specialized on the function their
+// head resolved to and valid as long as the guard on the head keeps the
+// version in the node's epoch.
+enum {
+    LQ_NONE,
+    LQ_ADD,
+    LQ_SUB,
+    LQ_MUL,
+    LQ_DIV,
+    LQ_BUILTIN,
+    LQ_LAMBDA
+};
+
+static const char lq_arith_ops[] = {
+    [LQ_ADD] = '+', [LQ_SUB] = '-', [LQ_MUL] = '*', [LQ_DIV] = '/'
+};
+
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry {
+    u64 hash;
+    lval *args;
+    lval *result;
+    lmemo_entry *chain;
+    lmemo_entry *prev;
+    lmemo_entry *next;
+};
+
+// Result cache of a memoized function, shared by all its copies. Entries
+// are chained in buckets by argument hash and kept in a list from most to
+// least recently used, evicting from the tail past `cap` entries.
+struct lmemo {
+    i32 refs;
+    i64 cap;
+    i64 count;
+    i64 nbuckets;
+    lmemo_entry **buckets;
+    lmemo_entry *head;
+    lmemo_entry *tail;
+};
+
+// Optimized body of a lambda, shared by all its copies. It's valid while the
+// guards at `guards` in the thread's list keep the versions in `vers`;
+// `epoch` is the last epoch that was checked at. `body` is NULL once the
+// lambda settled for its source.
+struct lopt {
+    i32 refs;
+    i32 retries;
+    i32 calls;      // since `body` was optimized, up to LOPT_MIN_CALLS
+    lval *body;
+    u64 epoch;
+    i32 count;
+    i32 *guards;
+    u64 *vers;
+};
+
+// Clone of a global environment, shared read-only by the 'pmap' workers,
+// futures and actors started while it was current. Each of them clones
+// the bindings it uses into a global environment of its own.
+struct lsnap {
+    atomic_int refs;
+    lenv *env;
+};
+
+// Epoch and guards of an evaluation that can run on any thread, swapped in
+// while it runs: a context's own, or those a future or actor saved from the
+// thread that started it.
+typedef struct lguards {
+    u64 epoch;
+    u64 mask;
+    i32 count;
+    char **syms;
+    u64 *vers;
+} lguards;
+
+// Evaluation started by 'spawn'. The expression and the environment are
+// private copies made at spawn time. Whoever comes first evaluates it: a
+// pool worker, or a thread awaiting the future while it's still queued.
+enum {
+    LFUT_QUEUED,
+    LFUT_RUNNING,
+    LFUT_DONE
+};
+
+struct lfuture {
+    atomic_int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    i32 state;
+    lenv *env;
+    lval *expr;
+    lval *result;
+    lguards guards; // the evaluation starts from, and then ends with
+};
+
+// Free list of an alisp_ctx. Nodes are plain malloc blocks, so a value can
+// be freed under another context, or none, than the one it came from.
+typedef struct lalloc {
+    lval *free;     // linked through `body`
+    i64 count;
+} lalloc;
+
+// Handler started by 'actor', run on the messages of its mailbox one at a
+// time by whichever worker is free. It has an environment and a heap of
+// its own, so it shares nothing with other threads but the mailbox.
+struct lactor {
+    atomic_int refs;
+    atomic_int scheduled;   // queued on the pool, or running
+    atomic_bool stopped;    // the handler failed, `error` says why
+    lchan *mailbox;
+    lenv *env;
+    lval *f;                // handler of the next message
+    lval *error;
+    lalloc alloc;
+    lguards guards;
+};
+
+// Heap part of a string longer than LSTR_INLINE bytes: either one block
+// or, for a long concatenation, a rope of two shared halves. Immutable, so
+// it's shared even between threads.
+struct lstr {
+    atomic_int refs;
+    i64 len;
+    i32 depth;      // 0 for a block
+    lstr *left;     // halves of a rope
+    lstr *right;
+    char data[];    // bytes of a block, and a NUL
+};
+
+// A function running as a coroutine on its own stack, handing values to
+// 'next' through 'yield'. Generators stay on the thread they were made on.
+enum {
+    LGEN_NEW,
+    LGEN_SUSPENDED,
+    LGEN_RUNNING,
+    LGEN_DONE
+};
+
+struct lgen {
+    i32 refs;
+    i32 state;
+    b8 closing;     // 'yield' fails from now on, to unwind the body
+    lenv *env;      // frames the generator was made in, up to `root`
+    lenv *root;
+    lval *f;
+    lval *value;    // last value yielded, or the error the body returned
+    char *stack;
+    ucontext_t self;
+    ucontext_t caller;
+    lgen *prev;     // generators alive on this thread
+    lgen *next;
+};
+
+static lval* lval_optimize_body(lenv *e, lval *formals, lval *body, i32 *changes);
+static lval* lval_clone(lval *v);
+static lopt* lopt_new(void);
+static void lopt_release(lopt *o);
+static void lopt_depend(lopt *o, i32 guard);
+static i32 lopt_optimize(lenv *e, lval *formals, lval *src, lopt *o);
+static lval* lval_body(lenv *e, lval *f);
+static void lmemo_release(lmemo *m);
+static void lfuture_release(lfuture *f);
+static void lgen_release(lgen *g);
+static void lactor_release(lactor *a);
+static lval* lval_exec_sexpr(lenv *e, lval *node);
+static void lenv_move(lenv *e, lval *k, lval *v);
+static void lhc_remove(lval *v);
+static lval* lval_vec_op(lenv *e, lval *v, char *op);
+static lval* lval_call1(lenv *e, lval *f, lval *x);
+
+// Allocator of the context evaluating on this thread, if any.
+static _Thread_local lalloc *lalloc_current = NULL;
+
+static _FORCE_INLINE_
+lval* lval_alloc_node(void) {
+    lalloc *a = lalloc_current;
+    if (a && a->free) {
+        lval *v = a->free;
+        a->free = v->body;
+        a->count--;
+        return v;
+    }
+    return (lval *)malloc(sizeof(lval));
+}
+
+static _FORCE_INLINE_
+void lval_free_node(lval *v) {
+    lalloc *a = lalloc_current;
+    if (a && a->count < LALLOC_KEEP) {
+        v->body = a->free;
+        a->free = v;
+        a->count++;
+        return;
+    }
+    free(v);
+}
 
-#define LVAL_ALLOC() ((lval *)malloc(sizeof(lval)))
+static _FORCE_INLINE_
+lval* lval_alloc(i32 type) {
+    lval *v = LVAL_ALLOC();
+    v->type = type;
+    v->interned = FALSE;
+    return v;
+}
 
 static
 char* ltype_name(i32 t) {
     switch(t) {
         case LVAL_FUN: return "Function";
         case LVAL_NUM: return "Number";
+        case LVAL_BIG: return "Big Number";
+        case LVAL_FLT: return "Float";
+        case LVAL_VEC: return "Vector";
+        case LVAL_FUT: return "Future";
+        case LVAL_GEN: return "Generator";
+        case LVAL_RANGE: return "Range";
+        case LVAL_STAGE: return "Stage";
+        case LVAL_STR: return "String";
+        case LVAL_MAP: return "Map";
+        case LVAL_CHAN: return "Channel";
+        case LVAL_ACTOR: return "Actor";
         case LVAL_ERR: return "Error";
         case LVAL_SYM: return "Symbol";
         case LVAL_SEXPR: return "S-Expression";
@@ -23,33 +306,297 @@ char* ltype_name(i32 t) {
     }
 }
 
-static
 lval* lval_num(i64 num) {
-    lval *out = malloc(sizeof(lval));
-    out->type = LVAL_NUM;
+    lval *out = lval_alloc(LVAL_NUM);
     out->num = num;
     return out;
 }
 
+lval* lval_flt(f64 flt) {
+    lval *out = lval_alloc(LVAL_FLT);
+    out->flt = flt;
+    return out;
+}
+
+static
+lval* lval_vec(i32 elem, i32 count) {
+    lval *out = lval_alloc(LVAL_VEC);
+    out->elem = elem;
+    out->count = count;
+    out->ints = malloc(sizeof(i64) * (count ? count : 1));
+    return out;
+}
+
+// The normal form of a range: one element has step 1, none start 0 too,
+// so equal sequences compare equal.
+static
+lval* lval_range(i64 start, i64 step, i64 len) {
+    lval *out = lval_alloc(LVAL_RANGE);
+    out->start = len ? start : 0;
+    out->step = len > 1 ? step : 1;
+    out->len = len;
+    return out;
+}
+
+// Makes a number out of `big`, taking ownership of it. Values that fit in
+// an i64 are always plain numbers.
+lval* lval_big(bignum *big) {
+    i64 num;
+    if (bn_to_i64(big, &num)) {
+        bn_free(big);
+        return lval_num(num);
+    }
+
+    lval *out = lval_alloc(LVAL_BIG);
+    out->big = big;
+    return out;
+}
+
+static
+lstr* lstr_alloc(i64 len) {
+    lstr *x = malloc(sizeof(lstr) + len + 1);
+    atomic_init(&x->refs, 1);
+    x->len = len;
+    x->depth = 0;
+    x->left = x->right = NULL;
+    x->data[len] = '\0';
+    return x;
+}
+
+static _FORCE_INLINE_
+lstr* lstr_share(lstr *x) {
+    atomic_fetch_add(&x->refs, 1);
+    return x;
+}
+
+static
+void lstr_release(lstr *x) {
+    if (atomic_fetch_sub(&x->refs, 1) != 1) return;
+    if (x->depth) {
+        lstr_release(x->left);
+        lstr_release(x->right);
+    }
+    free(x);
+}
+
+// Copies `n` bytes of `x` from offset `from` to `out`.
+static
+void lstr_write(lstr *x, i64 from, i64 n, char *out) {
+    while (n && x->depth) {
+        i64 half = x->left->len;
+        if (from < half) {
+            i64 k = n < half - from ? n : half - from;
+            lstr_write(x->left, from, k, out);
+            out += k;
+            n -= k;
+            from = 0;
+        } else {
+            from -= half;
+        }
+        x = x->right;
+    }
+    if (n) { memcpy(out, x->data + from, n); }
+}
+
+// Joins `l` and `r` into a rope, taking ownership of both.
+static
+lstr* lstr_rope(lstr *l, lstr *r) {
+    lstr *x = malloc(sizeof(lstr));
+    atomic_init(&x->refs, 1);
+    x->len = l->len + r->len;
+    x->depth = 1 + (l->depth > r->depth ? l->depth : r->depth);
+    x->left = l;
+    x->right = r;
+    if (x->depth <= LSTR_DEPTH_MAX) return x;
+
+    lstr *flat = lstr_alloc(x->len);
+    lstr_write(x, 0, x->len, flat->data);
+    lstr_release(x);
+    return flat;
+}
+
+// `n` bytes of `x` from offset `from`, sharing whole subtrees of a rope.
+static
+lstr* lstr_slice(lstr *x, i64 from, i64 n) {
+    if (from == 0 && n == x->len) return lstr_share(x);
+    i64 half = x->depth ? x->left->len : x->len;
+    if (x->depth && from + n <= half) return lstr_slice(x->left, from, n);
+    if (x->depth && from >= half) return lstr_slice(x->right, from - half, n);
+    if (x->depth) {
+        return lstr_rope(lstr_slice(x->left, from, half - from),
+                lstr_slice(x->right, 0, from + n - half));
+    }
+    lstr *y = lstr_alloc(n);
+    memcpy(y->data, x->data + from, n);
+    return y;
+}
+
+static _FORCE_INLINE_
+i64 lval_str_len(lval *v) {
+    return v->str ? v->str->len : v->count;
+}
+
+static
+void lval_str_write(lval *v, i64 from, i64 n, char *out) {
+    if (v->str) {
+        lstr_write(v->str, from, n, out);
+    } else {
+        memcpy(out, v->small + from, n);
+    }
+}
+
+// The bytes of `v` in one piece. A rope is copied into `*tmp`, for the
+// caller to free.
+static
+const char* lval_str_bytes(lval *v, char **tmp) {
+    *tmp = NULL;
+    if (!v->str) return v->small;
+    if (!v->str->depth) return v->str->data;
+    *tmp = malloc(v->str->len + 1);
+    lstr_write(v->str, 0, v->str->len, *tmp);
+    (*tmp)[v->str->len] = '\0';
+    return *tmp;
+}
+
+static
+lval* lval_str_of(lstr *x) {
+    lval *v = lval_alloc(LVAL_STR);
+    if (x->len > LSTR_INLINE) {
+        v->str = x;
+        v->count = 0;
+        return v;
+    }
+    v->str = NULL;
+    v->count = (i32)x->len;
+    lstr_write(x, 0, x->len, v->small);
+    v->small[v->count] = '\0';
+    lstr_release(x);
+    return v;
+}
+
+lval* lval_str(const char *s, i64 len) {
+    lval *v = lval_alloc(LVAL_STR);
+    v->str = NULL;
+    v->count = 0;
+    if (len > LSTR_INLINE) {
+        v->str = lstr_alloc(len);
+        memcpy(v->str->data, s, len);
+        return v;
+    }
+    v->count = (i32)len;
+    memcpy(v->small, s, len);
+    v->small[len] = '\0';
+    return v;
+}
+
+// The heap part of `v`, made for an inline string.
+static
+lstr* lval_str_node(lval *v) {
+    if (v->str) return lstr_share(v->str);
+    lstr *x = lstr_alloc(v->count);
+    memcpy(x->data, v->small, v->count);
+    return x;
+}
+
+// Concatenates the strings `x` and `y`, consuming both. Short results are
+// copied, long ones share the parts as a rope.
+static
+lval* lval_str_concat(lval *x, lval *y) {
+    i64 xn = lval_str_len(x), yn = lval_str_len(y);
+    lval *r;
+    if (!yn) {
+        lval_del(y);
+        return x;
+    }
+    if (!xn) {
+        lval_del(x);
+        return y;
+    }
+
+    if (xn + yn < LSTR_ROPE_MIN) {
+        char buf[LSTR_ROPE_MIN];
+        lval_str_write(x, 0, xn, buf);
+        lval_str_write(y, 0, yn, buf + xn);
+        r = lval_str(buf, xn + yn);
+    } else {
+        r = lval_str_of(lstr_rope(lval_str_node(x), lval_str_node(y)));
+    }
+    lval_del(x); lval_del(y);
+    return r;
+}
+
 static
 void lenv_def(lenv *e, lval *k, lval *v) {
     while (e->parent) { e = e->parent; }
     lenv_put(e, k, v);
 }
 
+static _FORCE_INLINE_
+lval* lval_share(lval *v) {
+    v->refs++;
+    return v;
+}
+
+static _FORCE_INLINE_
+void lval_release(lval *v) {
+    if (--v->refs == 0) { lval_del(v); }
+}
+
 static
 lval* lval_copy(lval *v) {
-    lval *copy = LVAL_ALLOC();
-    copy->type = v->type;
+    if (v->interned) { return lval_share(v); }
+    lval *copy = lval_alloc(v->type);
 
     switch (v->type) {
         case LVAL_NUM:
             copy->num = v->num; break;
+        case LVAL_FLT:
+            copy->flt = v->flt; break;
+        case LVAL_VEC:
+            copy->elem = v->elem;
+            copy->count = v->count;
+            copy->ints = malloc(sizeof(i64) * (v->count ? v->count : 1));
+            memcpy(copy->ints, v->ints, sizeof(i64) * v->count);
+            break;
+        case LVAL_BIG:
+            copy->big = bn_copy(v->big); break;
+        case LVAL_FUT:
+            copy->fut = v->fut;
+            atomic_fetch_add(&v->fut->refs, 1);
+            break;
+        case LVAL_GEN:
+            copy->gen = v->gen;
+            v->gen->refs++;
+            break;
+        case LVAL_RANGE:
+            copy->start = v->start;
+            copy->step = v->step;
+            copy->len = v->len;
+            break;
+        case LVAL_MAP:
+            copy->map = lmap_share(v->map);
+            break;
+        case LVAL_CHAN:
+            copy->chan = lchan_share(v->chan);
+            break;
+        case LVAL_ACTOR:
+            copy->actor = v->actor;
+            atomic_fetch_add(&v->actor->refs, 1);
+            break;
+        case LVAL_STR:
+            copy->count = v->count;
+            copy->str = v->str ? lstr_share(v->str) : NULL;
+            if (!v->str) { memcpy(copy->small, v->small, v->count + 1); }
+            break;
         case LVAL_FUN: {
             if (!v->fun) {
                 copy->fun = NULL; copy->env = lenv_copy(v->env);
                 copy->formals = lval_copy(v->formals);
-                copy->body = lval_copy(v->body);
+                copy->body = lval_share(v->body);
+                copy->opt = v->opt;
+                if (copy->opt) { copy->opt->refs++; }
+                copy->memo = v->memo;
+                if (copy->memo) { copy->memo->refs++; }
             } else {
                 copy->fun = v->fun; 
             }
@@ -66,13 +613,16 @@ lval* lval_copy(lval *v) {
             break;
 
         case LVAL_QEXPR:
-        case LVAL_SEXPR: {
+        case LVAL_SEXPR:
+        case LVAL_STAGE: {
             lval **cc = malloc(sizeof(lval *) * v->count);
             for (i32 i = 0; i < v->count; i++) {
                 cc[i] = lval_copy(v->cell[i]);
             }
             copy->cell = cc;
             copy->count = v->count;
+            copy->op = v->type == LVAL_STAGE ? v->op : LQ_NONE;
+            copy->epoch = 0;
             break;
         }
     }
@@ -81,9 +631,306 @@ lval* lval_copy(lval *v) {
 }
 
 static
+u64 lsym_hash(const char *s) {
+    u64 h = 14695981039346656037ULL;
+    while (*s) { h = (h ^ (u8)*s++) * 1099511628211ULL; }
+    return h;
+}
+
+static
+u64 lsym_hash_n(const char *s, i64 len) {
+    u64 h = 14695981039346656037ULL;
+    for (i64 i = 0; i < len; i++) { h = (h ^ (u8)s[i]) * 1099511628211ULL; }
+    return h;
+}
+
+static _FORCE_INLINE_
+u64 lhash_mix(u64 h, u64 x) {
+    return h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+// Structural hash, consistent with lval_eq.
+u64 lval_hash(lval *v) {
+    if (v->interned) { return v->hash; }
+    u64 h = lhash_mix(0, (u64)v->type);
+    switch (v->type) {
+        // Floats hash and compare by their bits, read through `num`.
+        case LVAL_NUM: case LVAL_FLT: return lhash_mix(h, (u64)v->num);
+        case LVAL_BIG: return lhash_mix(h, bn_hash(v->big));
+        case LVAL_SYM: return lhash_mix(h, lsym_hash(v->sym));
+        case LVAL_ERR: return lhash_mix(h, lsym_hash(v->err));
+        case LVAL_MAP: {
+            // The sum doesn't depend on the order of the entries.
+            u64 sum = 0;
+            lval *k, *x;
+            for (i64 i = 0; lmap_next(v->map, &i, &k, &x); ) {
+                sum += lhash_mix(lval_hash(k), lval_hash(x));
+            }
+            return lhash_mix(h, sum);
+        }
+        case LVAL_STR: {
+            char *tmp;
+            const char *s = lval_str_bytes(v, &tmp);
+            for (i64 i = 0, n = lval_str_len(v); i < n; i++) {
+                h = (h ^ (u8)s[i]) * 1099511628211ULL;
+            }
+            free(tmp);
+            return lhash_mix(h, (u64)lval_str_len(v));
+        }
+        case LVAL_VEC:
+            h = lhash_mix(h, (u64)v->elem);
+            for (i32 i = 0; i < v->count; i++) {
+                h = lhash_mix(h, (u64)v->ints[i]);
+            }
+            return h;
+        case LVAL_FUT: return lhash_mix(h, (u64)(uintptr_t)v->fut);
+        case LVAL_CHAN: return lhash_mix(h, (u64)(uintptr_t)v->chan);
+        case LVAL_ACTOR: return lhash_mix(h, (u64)(uintptr_t)v->actor);
+        case LVAL_GEN: return lhash_mix(h, (u64)(uintptr_t)v->gen);
+        case LVAL_RANGE:
+            h = lhash_mix(h, (u64)v->start);
+            return lhash_mix(lhash_mix(h, (u64)v->step), (u64)v->len);
+        case LVAL_FUN:
+            if (v->fun) { return lhash_mix(h, (u64)(uintptr_t)v->fun); }
+            h = lhash_mix(h, lval_hash(v->formals));
+            return lhash_mix(h, lval_hash(v->body));
+        case LVAL_STAGE:
+            h = lhash_mix(h, (u64)v->op);
+            // fallthrough
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            for (i32 i = 0; i < v->count; i++) {
+                h = lhash_mix(h, lval_hash(v->cell[i]));
+            }
+            return h;
+    }
+    return h;
+}
+
+static
+b8 lenv_eq(lenv *x, lenv *y) {
+    if (x->count != y->count) return FALSE;
+    for (i32 i = 0; i < x->count; i++) {
+        if (strcmp(x->syms[i], y->syms[i]) != 0) return FALSE;
+        if (!lval_eq(x->vals[i], y->vals[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+b8 lval_eq(lval *x, lval *y) {
+    if (x == y) return TRUE;
+    if (x->interned && y->interned) return FALSE;
+    if (x->type != y->type) return FALSE;
+    switch (x->type) {
+        case LVAL_NUM: case LVAL_FLT: return x->num == y->num;
+        case LVAL_BIG: return bn_cmp(x->big, y->big) == 0;
+        case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+        case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+        case LVAL_MAP: {
+            if (x->map == y->map) return TRUE;
+            if (lmap_count(x->map) != lmap_count(y->map)) return FALSE;
+            lval *k, *a;
+            for (i64 i = 0; lmap_next(x->map, &i, &k, &a); ) {
+                lval *b = lmap_get(y->map, k);
+                if (!b || !lval_eq(a, b)) return FALSE;
+            }
+            return TRUE;
+        }
+        case LVAL_STR: {
+            if (x->str == y->str && x->str) return TRUE;
+            if (lval_str_len(x) != lval_str_len(y)) return FALSE;
+            char *tx, *ty;
+            b8 eq = memcmp(lval_str_bytes(x, &tx), lval_str_bytes(y, &ty), lval_str_len(x)) == 0;
+            free(tx); free(ty);
+            return eq;
+        }
+        case LVAL_VEC:
+            return x->elem == y->elem && x->count == y->count
+                && memcmp(x->ints, y->ints, sizeof(i64) * x->count) == 0;
+        case LVAL_FUT: return x->fut == y->fut;
+        case LVAL_CHAN: return x->chan == y->chan;
+        case LVAL_ACTOR: return x->actor == y->actor;
+        case LVAL_GEN: return x->gen == y->gen;
+        case LVAL_RANGE:
+            return x->start == y->start && x->step == y->step && x->len == y->len;
+        case LVAL_FUN:
+            if (x->fun || y->fun) { return x->fun == y->fun; }
+            return lval_eq(x->formals, y->formals)
+                && lval_eq(x->body, y->body)
+                && lenv_eq(x->env, y->env);
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+        case LVAL_STAGE:
+            if (x->op != y->op && x->type == LVAL_STAGE) return FALSE;
+            if (x->count != y->count) return FALSE;
+            for (i32 i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) return FALSE;
+            }
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// In hash-consing mode symbols, and Q-expressions built only from numbers,
+// symbols and such Q-expressions, are deduplicated through a weak table:
+// values don't stay alive because they're in it, and remove themselves
+// when their last reference goes. Shared values are immutable, code that
+// edits a list in place takes a private copy with lval_unshare first.
+// Each thread has its own table, 'pmap' workers don't intern at all.
+static _Thread_local b8 lhc_enabled = FALSE;
+static _Thread_local lval **lhc_table = NULL;
+static _Thread_local u64 lhc_cap = 0;
+static _Thread_local u64 lhc_count = 0;
+
+void lval_set_hashcons(b8 enabled) {
+    lhc_enabled = enabled;
+}
+
+// Compares a candidate with a table entry. Children of both are either
+// shared, and compared by identity, or numbers.
+static
+b8 lhc_same(lval *x, lval *y) {
+    if (x->type != y->type) return FALSE;
+    if (x->type == LVAL_SYM) return strcmp(x->sym, y->sym) == 0;
+    if (x->count != y->count) return FALSE;
+    for (i32 i = 0; i < x->count; i++) {
+        lval *a = x->cell[i], *b = y->cell[i];
+        if (a->interned || b->interned) {
+            if (a != b) return FALSE;
+        } else if (a->type != b->type || a->num != b->num) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+lval* lhc_find(u64 hash, lval *v) {
+    if (!lhc_cap) return NULL;
+    u64 mask = lhc_cap - 1;
+    for (u64 i = hash & mask; lhc_table[i]; i = (i + 1) & mask) {
+        if (lhc_table[i]->hash == hash && lhc_same(lhc_table[i], v)) {
+            return lhc_table[i];
+        }
+    }
+    return NULL;
+}
+
+static
+lval* lhc_find_sym(u64 hash, const char *sym, i64 len) {
+    if (!lhc_cap) return NULL;
+    u64 mask = lhc_cap - 1;
+    for (u64 i = hash & mask; lhc_table[i]; i = (i + 1) & mask) {
+        lval *x = lhc_table[i];
+        if (x->hash == hash && x->type == LVAL_SYM
+                && strncmp(x->sym, sym, len) == 0 && x->sym[len] == '\0') {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+static
+void lhc_place(lval **table, u64 cap, lval *v) {
+    u64 i = v->hash & (cap - 1);
+    while (table[i]) { i = (i + 1) & (cap - 1); }
+    table[i] = v;
+}
+
+static
+void lhc_insert(lval *v) {
+    if ((lhc_count + 1) * 2 > lhc_cap) {
+        u64 cap = lhc_cap ? lhc_cap * 2 : 256;
+        lval **table = calloc(cap, sizeof(lval *));
+        for (u64 i = 0; i < lhc_cap; i++) {
+            if (lhc_table[i]) { lhc_place(table, cap, lhc_table[i]); }
+        }
+        free(lhc_table);
+        lhc_table = table;
+        lhc_cap = cap;
+    }
+    lhc_place(lhc_table, lhc_cap, v);
+    lhc_count++;
+}
+
+static
+void lhc_remove(lval *v) {
+    u64 mask = lhc_cap - 1;
+    u64 i = v->hash & mask;
+    while (lhc_table[i] != v) { i = (i + 1) & mask; }
+
+    // Shift later entries of the probe run back over the hole, unless
+    // that would move them before their home slot.
+    for (u64 j = (i + 1) & mask; lhc_table[j]; j = (j + 1) & mask) {
+        u64 home = lhc_table[j]->hash & mask;
+        b8 stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            lhc_table[i] = lhc_table[j];
+            i = j;
+        }
+    }
+    lhc_table[i] = NULL;
+
+    if (--lhc_count == 0) {
+        free(lhc_table);
+        lhc_table = NULL;
+        lhc_cap = 0;
+    }
+}
+
+static
+lval* lhc_intern(lval *v, u64 hash) {
+    v->interned = TRUE;
+    v->refs = 1;
+    v->hash = hash;
+    lhc_insert(v);
+    return v;
+}
+
+// Returns the shared value equal to `v`, consuming `v`, or makes `v` the
+// shared one. Does nothing outside hash-consing mode or for values that
+// can't be shared.
+lval* lval_hcons(lval *v) {
+    if (!lhc_enabled || v->interned) return v;
+
+    if (v->type == LVAL_QEXPR) {
+        for (i32 i = 0; i < v->count; i++) {
+            lval *x = v->cell[i] = lval_hcons(v->cell[i]);
+            if (!x->interned && x->type != LVAL_NUM && x->type != LVAL_FLT) return v;
+        }
+    } else if (v->type != LVAL_SYM) {
+        return v;
+    }
+
+    u64 hash = lval_hash(v);
+    lval *x = lhc_find(hash, v);
+    if (x) {
+        lval_del(v);
+        return lval_share(x);
+    }
+    return lhc_intern(v, hash);
+}
+
+// Returns a private copy of the shared Q-expression `v`, consuming it, or
+// `v` itself if it isn't shared. Symbols are never edited in place.
+static
+lval* lval_unshare(lval *v) {
+    if (!v->interned) return v;
+
+    lval *x = lval_alloc(LVAL_QEXPR);
+    x->count = v->count;
+    x->cell = malloc(sizeof(lval *) * v->count);
+    for (i32 i = 0; i < v->count; i++) {
+        x->cell[i] = lval_copy(v->cell[i]);
+    }
+    x->op = LQ_NONE;
+    x->epoch = 0;
+    lval_del(v);
+    return x;
+}
+
 lval* lval_err(char *fmt, ...) {
-    lval *out = malloc(sizeof(lval));
-    out->type = LVAL_ERR;
+    lval *out = lval_alloc(LVAL_ERR);
 
     va_list va;
     va_start(va, fmt);
@@ -97,42 +944,51 @@ lval* lval_err(char *fmt, ...) {
     return out;
 }
 
-static
 lval* lval_sym(char *sym) {
-    lval *out = malloc(sizeof(lval));
-    out->type = LVAL_SYM;
-    out->sym = (char *)malloc(strlen(sym) + 1);
-    strcpy(out->sym, sym);
-    return out;
+    return lval_sym_n(sym, (i64)strlen(sym));
+}
+
+// The slice is looked up as it is, it's only copied for a new symbol.
+lval* lval_sym_n(const char *sym, i64 len) {
+    u64 hash = 0;
+    if (lhc_enabled) {
+        hash = lhash_mix(lhash_mix(0, LVAL_SYM), lsym_hash_n(sym, len));
+        lval *x = lhc_find_sym(hash, sym, len);
+        if (x) return lval_share(x);
+    }
+
+    lval *out = lval_alloc(LVAL_SYM);
+    out->sym = (char *)malloc(len + 1);
+    memcpy(out->sym, sym, len);
+    out->sym[len] = '\0';
+    return lhc_enabled ? lhc_intern(out, hash) : out;
 }
 
 static
 lval* lval_fun(lbuiltin fun) {
-    lval *out = malloc(sizeof(lval));
-    out->type = LVAL_FUN;
+    lval *out = lval_alloc(LVAL_FUN);
     out->fun = fun;
     return out;
 }
 
-static
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval *v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->op = LQ_NONE;
+  v->epoch = 0;
   return v;
 }
 
-static
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval *v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->op = LQ_NONE;
+  v->epoch = 0;
   return v;
 }
 
-static
 lval* lval_add(lval *v, lval *x) {
     v->count++;
     v->cell = realloc(v->cell, v->count * sizeof(lval*));
@@ -159,12 +1015,15 @@ lval* lval_take(lval* v, i32 i) {
 
 static
 lval* lval_lambda(lval *formals, lval *body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_alloc(LVAL_FUN);
   v->fun = NULL;
   v->env = lenv_new();
   v->formals = formals;
   v->body = body;
+  v->opt = NULL;
+  v->epoch = 0;
+  v->memo = NULL;
+  body->refs = 1;
   return v;
 }
 
@@ -181,69 +1040,464 @@ lval *builtin_lambda(lenv *e, lval *v) {
                 ltype_name(v->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
     }
 
-    lval *formals = lval_pop(v, 0);
-    lval *body = lval_pop(v, 0);
+    lval *formals = lval_unshare(lval_pop(v, 0));
+    lval *body = lval_unshare(lval_pop(v, 0));
     lval_del(v);
 
-    return lval_lambda(formals, body);
+    lval *f = lval_lambda(formals, body);
+    f->opt = lopt_new();
+    if (!lopt_optimize(e, formals, body, f->opt)) {
+        lopt_release(f->opt);
+        f->opt = NULL;
+    }
+    return f;
+}
+
+// Applies `op` to two numbers. Returns FALSE when the result isn't an i64,
+// on overflow or division by zero, leaving it to builtin_op.
+static _FORCE_INLINE_
+b8 lnum_op(char op, i64 x, i64 y, i64 *out) {
+    i64 r;
+    switch (op) {
+        case '+': if (__builtin_add_overflow(x, y, &r)) return FALSE; break;
+        case '-': if (__builtin_sub_overflow(x, y, &r)) return FALSE; break;
+        case '*': if (__builtin_mul_overflow(x, y, &r)) return FALSE; break;
+        case '/':
+            if (y == 0 || (x == INT64_MIN && y == -1)) return FALSE;
+            r = x / y;
+            break;
+        default: return FALSE;
+    }
+    *out = r;
+    return TRUE;
+}
+
+static _FORCE_INLINE_
+f64 lflt_op(char op, f64 x, f64 y) {
+    switch (op) {
+        case '+': return x + y;
+        case '-': return x - y;
+        case '*': return x * y;
+        default:  return x / y;
+    }
+}
+
+static
+f64 lval_to_f64(lval *v) {
+    switch (v->type) {
+        case LVAL_FLT: return v->flt;
+        case LVAL_BIG: return bn_to_f64(v->big);
+        default:       return (f64)v->num;
+    }
+}
+
+static
+bignum* lbig_op(char op, bignum *x, bignum *y) {
+    switch (op) {
+        case '+': return bn_add(x, y);
+        case '-': return bn_sub(x, y);
+        case '*': return bn_mul(x, y);
+        default:  return bn_div(x, y);
+    }
 }
 
+// Numbers stay i64 while they can and are only promoted to bignums, for
+// the rest of the operation, when a result overflows. Bignum results are
+// demoted again as soon as they fit. The first float operand turns the
+// running result into a float, and float division follows IEEE 754.
 static
 lval* builtin_op(lenv *e, lval *first, char* op) {
+    LASSERT(first, first->count > 0, "'%s' needs at least one argument", op);
     for (int i = 0; i < first->count; i++) {
-        if (first->cell[i]->type != LVAL_NUM) {
+        i32 t = first->cell[i]->type;
+        if (t == LVAL_VEC) { return lval_vec_op(e, first, op); }
+        if (t != LVAL_NUM && t != LVAL_BIG && t != LVAL_FLT) {
             lval_del(first);
             return lval_err("Cannot operate on non-number!");
         }
     }
 
-    lval* x = lval_pop(first, 0);
-    if ((strcmp(op, "-") == 0) && first->count == 0) {
-        x->num = -x->num;
+    i64 x = 0;
+    bignum *big = NULL;
+    f64 f = 0;
+    b8 flt = first->cell[0]->type == LVAL_FLT;
+    if (flt) {
+        f = first->cell[0]->flt;
+    } else if (first->cell[0]->type == LVAL_BIG) {
+        big = bn_copy(first->cell[0]->big);
+    } else {
+        x = first->cell[0]->num;
+    }
+
+    if (op[0] == '-' && first->count == 1) {
+        if (flt) {
+            f = -f;
+        } else if (!big && x != INT64_MIN) {
+            x = -x;
+        } else {
+            bignum *b = big ? big : bn_from_i64(x);
+            big = bn_neg(b);
+            bn_free(b);
+        }
     }
 
-    while (first->count > 0) {
-        lval* y = lval_pop(first, 0);
+    for (i32 i = 1; i < first->count; i++) {
+        lval *y = first->cell[i];
+        if (!flt && y->type == LVAL_FLT) {
+            f = big ? bn_to_f64(big) : (f64)x;
+            if (big) { bn_free(big); big = NULL; }
+            flt = TRUE;
+        }
+        if (flt) {
+            f = lflt_op(op[0], f, lval_to_f64(y));
+            continue;
+        }
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y == 0) {
-                lval_del(x); lval_del(y);
-                lval_err("division by zero"); break;
-            }
-            x->num /= y->num;
+        b8 zero = y->type == LVAL_NUM ? y->num == 0 : bn_is_zero(y->big);
+        if (op[0] == '/' && zero) {
+            if (big) { bn_free(big); }
+            lval_del(first);
+            return lval_err("division by zero");
         }
 
-        lval_del(y);
+        if (!big && y->type == LVAL_NUM && lnum_op(op[0], x, y->num, &x)) {
+            continue;
+        }
+
+        if (!big) { big = bn_from_i64(x); }
+        bignum *b = y->type == LVAL_BIG ? y->big : bn_from_i64(y->num);
+        bignum *r = lbig_op(op[0], big, b);
+        if (b != y->big) { bn_free(b); }
+        bn_free(big);
+        big = r;
+
+        if (bn_to_i64(big, &x)) {
+            bn_free(big);
+            big = NULL;
+        }
     }
     lval_del(first);
 
-    return x;
+    if (flt) { return lval_flt(f); }
+    return big ? lval_big(big) : lval_num(x);
 }
 
-static
-lval* builtin_head(lenv *e, lval *v) {
-    LASSERT(v, v->count == 1, "'head' too many arguments");
+// Ranges are lazy sequences of integers, `step` apart. The list builtins
+// and the reductions work on them in constant space, anything else needs
+// their elements in a Q-expression.
+static _FORCE_INLINE_
+i64 lrange_at(lval *r, i64 i) {
+    return (i64)((u64)r->start + (u64)r->step * (u64)i);
+}
+
+static _FORCE_INLINE_
+i64 lrange_last(lval *r) {
+    return lrange_at(r, r->len - 1);
+}
+
+// Lists the elements of `r`, consuming it.
+static
+lval* lrange_list(lval *r) {
+    if (r->len > INT32_MAX) {
+        lval_del(r);
+        return lval_err("range is too long to be listed");
+    }
+    lval *q = lval_qexpr();
+    q->count = (i32)r->len;
+    q->cell = malloc(sizeof(lval *) * (q->count ? q->count : 1));
+    for (i32 i = 0; i < q->count; i++) {
+        q->cell[i] = lval_num(lrange_at(r, i));
+    }
+    lval_del(r);
+    return lval_hcons(q);
+}
+
+// Appends `y` to the private range `x` when its elements carry on those of
+// `x`, the result being a range again.
+static
+b8 lrange_extend(lval *x, lval *y) {
+    if (y->len == 0) return TRUE;
+    if (x->len == 0) {
+        x->start = y->start; x->step = y->step; x->len = y->len;
+        return TRUE;
+    }
+
+    i64 step = x->len > 1 ? x->step : y->step, next, len;
+    if (x->len == 1 && y->len == 1 && __builtin_sub_overflow(y->start, x->start, &step)) {
+        return FALSE;
+    }
+    if (step == 0 || (y->len > 1 && y->step != step)) return FALSE;
+    if (__builtin_add_overflow(lrange_last(x), step, &next) || next != y->start) return FALSE;
+    if (__builtin_add_overflow(x->len, y->len, &len)) return FALSE;
+    x->step = step;
+    x->len = len;
+    return TRUE;
+}
+
+// n * start + step * n * (n - 1) / 2, exactly.
+static
+lval* lrange_sum(lval *r) {
+    i64 n = r->len;
+    i64 a = n % 2 ? n : n / 2, b = n % 2 ? (n - 1) / 2 : n - 1;
+    i64 t, s, u, sum;
+    if (!__builtin_mul_overflow(a, b, &t) && !__builtin_mul_overflow(r->step, t, &s)
+            && !__builtin_mul_overflow(r->start, n, &u) && !__builtin_add_overflow(u, s, &sum)) {
+        return lval_num(sum);
+    }
+
+    bignum *ba = bn_from_i64(a), *bb = bn_from_i64(b), *bt = bn_mul(ba, bb);
+    bignum *bstep = bn_from_i64(r->step), *bs = bn_mul(bstep, bt);
+    bignum *bstart = bn_from_i64(r->start), *bn = bn_from_i64(n), *bu = bn_mul(bstart, bn);
+    bignum *out = bn_add(bu, bs);
+    bn_free(ba); bn_free(bb); bn_free(bt); bn_free(bstep); bn_free(bs);
+    bn_free(bstart); bn_free(bn); bn_free(bu);
+    return lval_big(out);
+}
+
+static
+lval* lrange_product(lval *r) {
+    // A range through 0 would overflow long before reaching it.
+    u64 stride = r->step > 0 ? (u64)r->step : (u64)0 - (u64)r->step;
+    i64 lo = r->step > 0 ? r->start : lrange_last(r);
+    i64 hi = r->step > 0 ? lrange_last(r) : r->start;
+    if (r->len && lo <= 0 && hi >= 0 && ((u64)0 - (u64)lo) % stride == 0) {
+        return lval_num(0);
+    }
+
+    i64 acc = 1, i = 0, next;
+    for (; i < r->len && !__builtin_mul_overflow(acc, lrange_at(r, i), &next); i++) {
+        acc = next;
+    }
+    if (i == r->len) return lval_num(acc);
+
+    bignum *big = bn_from_i64(acc);
+    for (; i < r->len; i++) {
+        bignum *x = bn_from_i64(lrange_at(r, i)), *p = bn_mul(big, x);
+        bn_free(x); bn_free(big);
+        big = p;
+    }
+    return lval_big(big);
+}
+
+// (range a b) or (range a b step) is the sequence of integers from `a`
+// up to, or down to, `b` excluded, `step` apart.
+static
+lval* builtin_range(lenv *e, lval *v) {
+    LASSERT(v, v->count == 2 || v->count == 3,
+            "'range' passed incorrect number of arguments. Got %i, expected 2 or 3.",
+            v->count);
+    for (i32 i = 0; i < v->count; i++) {
+        LASSERT_TYPE("range", v, i, LVAL_NUM);
+    }
+    i64 a = v->cell[0]->num, b = v->cell[1]->num;
+    i64 step = v->count == 3 ? v->cell[2]->num : 1;
+    LASSERT(v, step != 0, "'range' step cannot be 0");
+
+    u64 span = 0, stride = step > 0 ? (u64)step : (u64)0 - (u64)step;
+    if (step > 0 && a < b) { span = (u64)b - (u64)a; }
+    if (step < 0 && a > b) { span = (u64)a - (u64)b; }
+    u64 len = span ? (span - 1) / stride + 1 : 0;
+    LASSERT(v, len <= INT64_MAX, "'range' has too many elements");
+    lval_del(v);
+    return lval_range(a, step, (i64)len);
+}
+
+// (concat s...) joins strings.
+static
+lval* builtin_concat(lenv *e, lval *v) {
+    for (i32 i = 0; i < v->count; i++) {
+        LASSERT_TYPE("concat", v, i, LVAL_STR);
+    }
+    lval *x = lval_str("", 0);
+    while (v->count) { x = lval_str_concat(x, lval_pop(v, 0)); }
+    lval_del(v);
+    return x;
+}
+
+// (substr s start n) is the `n` bytes of `s` from `start` on.
+static
+lval* builtin_substr(lenv *e, lval *v) {
+    LASSERT_NARGS("substr", v, 3);
+    LASSERT_TYPE("substr", v, 0, LVAL_STR);
+    LASSERT_TYPE("substr", v, 1, LVAL_NUM);
+    LASSERT_TYPE("substr", v, 2, LVAL_NUM);
+    lval *x = v->cell[0];
+    i64 from = v->cell[1]->num, n = v->cell[2]->num, len = lval_str_len(x);
+    LASSERT(v, from >= 0 && n >= 0 && from <= len && n <= len - from,
+            "'substr' range %lli+%lli is out of bounds for a string of length %lli",
+            from, n, len);
+
+    lval *r;
+    if (n <= LSTR_INLINE || !x->str) {
+        char buf[LSTR_INLINE + 1];
+        lval_str_write(x, from, n, buf);
+        r = lval_str(buf, n);
+    } else {
+        r = lval_str_of(lstr_slice(x->str, from, n));
+    }
+    lval_del(v);
+    return r;
+}
+
+// Offset of the first `p` in `s`, or -1. memchr finds the candidates, a
+// vectorized scan in any libc worth the name.
+static
+i64 lstr_find(const char *s, i64 n, const char *p, i64 m) {
+    if (m == 0) return 0;
+    if (m > n) return -1;
+    const char *at = s, *end = s + n - m + 1;
+    while (at < end && (at = memchr(at, p[0], end - at))) {
+        if (memcmp(at + 1, p + 1, m - 1) == 0) return at - s;
+        at++;
+    }
+    return -1;
+}
+
+// (find s p) is the offset of the first occurrence of `p` in `s`, or -1.
+static
+lval* builtin_find(lenv *e, lval *v) {
+    LASSERT_NARGS("find", v, 2);
+    LASSERT_TYPE("find", v, 0, LVAL_STR);
+    LASSERT_TYPE("find", v, 1, LVAL_STR);
+    char *ts, *tp;
+    const char *s = lval_str_bytes(v->cell[0], &ts);
+    const char *p = lval_str_bytes(v->cell[1], &tp);
+    i64 at = lstr_find(s, lval_str_len(v->cell[0]), p, lval_str_len(v->cell[1]));
+    free(ts); free(tp);
+    lval_del(v);
+    return lval_num(at);
+}
+
+static
+b8 lmap_key_ok(lval *k) {
+    return k->type == LVAL_NUM || k->type == LVAL_BIG || k->type == LVAL_FLT
+        || k->type == LVAL_SYM || k->type == LVAL_STR;
+}
+
+// Takes a map argument out of `v` for changing it, copying the table when
+// other values share it.
+static
+lval* lval_map_own(lval *v, i32 i) {
+    lval *m = lval_pop(v, i);
+    if (lmap_shared(m->map)) {
+        lmap *copy = lmap_copy(m->map, lval_copy);
+        lmap_release(m->map);
+        m->map = copy;
+    }
+    return m;
+}
+
+// (hashmap k v ...) makes a map of the given keys and values, which later
+// ones override. Keys are numbers, symbols or strings. The keys and values
+// can also come as one list, (hashmap {}) being the empty map.
+static
+lval* builtin_hashmap(lenv *e, lval *v) {
+    if (v->count == 1 && v->cell[0]->type == LVAL_QEXPR) {
+        v = lval_unshare(lval_take(v, 0));
+    }
+    LASSERT(v, v->count % 2 == 0, "'hashmap' passed an odd number of arguments");
+    for (i32 i = 0; i < v->count; i += 2) {
+        LASSERT(v, lmap_key_ok(v->cell[i]), "'hashmap' key %i cannot be of type %s",
+                i / 2, ltype_name(v->cell[i]->type));
+    }
+    lval *m = lval_alloc(LVAL_MAP);
+    m->map = lmap_new();
+    while (v->count) {
+        lval *k = lval_pop(v, 0);
+        lmap_put(m->map, k, lval_pop(v, 0));
+    }
+    lval_del(v);
+    return m;
+}
+
+// (get m k) is the value of `k` in `m`, (get m k default) gives `default`
+// instead of an error when there's none.
+static
+lval* builtin_get(lenv *e, lval *v) {
+    LASSERT(v, v->count == 2 || v->count == 3,
+            "'get' passed incorrect number of arguments. Got %i, expected 2 or 3.", v->count);
+    LASSERT_TYPE("get", v, 0, LVAL_MAP);
+    lval *x = lmap_get(v->cell[0]->map, v->cell[1]);
+    LASSERT(v, x || v->count == 3, "'get' key not found");
+    x = x ? lval_copy(x) : lval_pop(v, 2);
+    lval_del(v);
+    return x;
+}
+
+// (put m k v) is `m` with `k` bound to `v`.
+static
+lval* builtin_put_map(lenv *e, lval *v) {
+    LASSERT_NARGS("put", v, 3);
+    LASSERT_TYPE("put", v, 0, LVAL_MAP);
+    LASSERT(v, lmap_key_ok(v->cell[1]), "'put' key cannot be of type %s",
+            ltype_name(v->cell[1]->type));
+    lval *m = lval_map_own(v, 0);
+    lval *k = lval_pop(v, 0);
+    lmap_put(m->map, k, lval_pop(v, 0));
+    lval_del(v);
+    return m;
+}
+
+// (delete m k) is `m` without `k`.
+static
+lval* builtin_delete(lenv *e, lval *v) {
+    LASSERT_NARGS("delete", v, 2);
+    LASSERT_TYPE("delete", v, 0, LVAL_MAP);
+    if (!lmap_get(v->cell[0]->map, v->cell[1])) return lval_take(v, 0);
+    lval *m = lval_map_own(v, 0);
+    lmap_remove(m->map, v->cell[0]);
+    lval_del(v);
+    return m;
+}
+
+// (keys m) lists the keys of `m`, in no particular order.
+static
+lval* builtin_keys(lenv *e, lval *v) {
+    LASSERT_NARGS("keys", v, 1);
+    LASSERT_TYPE("keys", v, 0, LVAL_MAP);
+    lval *q = lval_qexpr();
+    lval *k, *x;
+    for (i64 i = 0; lmap_next(v->cell[0]->map, &i, &k, &x); ) {
+        lval_add(q, lval_copy(k));
+    }
+    lval_del(v);
+    return lval_hcons(q);
+}
+
+static
+lval* builtin_head(lenv *e, lval *v) {
+    LASSERT(v, v->count == 1, "'head' too many arguments");
+    if (v->cell[0]->type == LVAL_RANGE) {
+        LASSERT(v, v->cell[0]->len != 0, "'head' cannot work on empty range");
+        lval *x = lval_num(v->cell[0]->start);
+        lval_del(v);
+        return lval_hcons(lval_add(lval_qexpr(), x));
+    }
     LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
             "'head' incorrect type for argument 0. Got %s, Expected %s", ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
     LASSERT(v, v->cell[0]->count != 0, "'head' cannot work on empty qexpr {}");
-    lval *result = lval_take(v, 0);
+    lval *result = lval_unshare(lval_take(v, 0));
     while (result->count > 1) { lval_del(lval_pop(result, 1)); }
-    return result;
+    return lval_hcons(result);
 }
 
 static
 lval* builtin_tail(lenv *e, lval *v) {
     LASSERT(v, v->count == 1, "'tail' too many arguments");
+    if (v->cell[0]->type == LVAL_RANGE) {
+        lval *r = v->cell[0];
+        LASSERT(v, r->len != 0, "'tail' cannot work on empty range");
+        lval *x = lval_range(r->len > 1 ? r->start + r->step : 0, r->step, r->len - 1);
+        lval_del(v);
+        return x;
+    }
     LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
             "'tail' incorrect type for argument 0. Got %s, Expected %s",
             ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
     LASSERT(v, v->cell[0]->count != 0, "'tail' cannot work on empty qexpr {}");
-    lval *result = lval_take(v, 0);
+    lval *result = lval_unshare(lval_take(v, 0));
     lval_del(lval_pop(result, 0));
-    return result;
+    return lval_hcons(result);
 }
 
 static
@@ -252,38 +1506,54 @@ lval* builtin_eval(lenv *e, lval *v) {
     LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
             "'eval' incorrect type for argument 0. Got %s, Expected %s",
             ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
-    lval *x = lval_take(v, 0);
+    lval *x = lval_unshare(lval_take(v, 0));
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
 
+// Appends the cells of `v2` to the private `v1`, consuming `v2`.
 static
 lval *lval_join(lval *v1, lval *v2) {
-    while (v2->count) {
-        lval *popped = lval_pop(v2, 0);
-        v1 = lval_add(v1, popped);
-    }
+    v2 = lval_unshare(v2);
+    v1->cell = realloc(v1->cell, sizeof(lval *) * (v1->count + v2->count));
+    memcpy(&v1->cell[v1->count], v2->cell, sizeof(lval *) * v2->count);
+    v1->count += v2->count;
+    v2->count = 0;
     lval_del(v2);
     return v1;
 }
 
 
+// Ranges that carry on one another join into a range, any other mix is
+// joined as lists.
 static
 lval* builtin_join(lenv *e, lval *v) {
     for (i32 i = 0; i < v->count; i++) {
-        LASSERT(v, v->cell[i]->type == LVAL_QEXPR,
+        LASSERT(v, v->cell[i]->type == LVAL_QEXPR || v->cell[i]->type == LVAL_RANGE,
                 "'join' incorrect type for argument %d. Got %s, Expected %s",
                 i, ltype_name(v->cell[i]->type), ltype_name(LVAL_QEXPR));
     }
 
     lval *x = lval_pop(v, 0);
-    while (v->count) {
-        lval *popped = lval_pop(v, 0);
-        x = lval_join(x, popped);
+    for (i32 i = 0; i < v->count; i++) {
+        lval *y = v->cell[i];
+        v->cell[i] = lval_sexpr();
+        if (x->type == LVAL_RANGE && y->type == LVAL_RANGE && lrange_extend(x, y)) {
+            lval_del(y);
+            continue;
+        }
+        x = x->type == LVAL_RANGE ? lrange_list(x) : lval_unshare(x);
+        y = y->type == LVAL_RANGE ? lrange_list(y) : y;
+        if (x->type == LVAL_ERR || y->type == LVAL_ERR) {
+            if (x->type == LVAL_ERR) { lval_del(y); } else { lval_del(x); x = y; }
+            lval_del(v);
+            return x;
+        }
+        x = lval_join(x, y);
     }
 
     lval_del(v);
-    return x;
+    return x->type == LVAL_RANGE ? x : lval_hcons(x);
 }
 
 static
@@ -295,152 +1565,2330 @@ lval* builtin_cons(lenv *e, lval *v) {
             "'cons' incorrect type for argument 0. Got %s, Expected %s or %s",
             ltype_name(v1->type), ltype_name(LVAL_NUM), ltype_name(LVAL_SYM));
 
-    lval *v2 = lval_pop(v, 0);
-    LASSERT(v2, v2->type == LVAL_QEXPR,
-            "'cons' incorrect type for argument 1. Got %s, Expected %s",
-            ltype_name(v2->type), ltype_name(LVAL_QEXPR));
+    lval *v2 = lval_pop(v, 0);
+    LASSERT(v2, v2->type == LVAL_QEXPR,
+            "'cons' incorrect type for argument 1. Got %s, Expected %s",
+            ltype_name(v2->type), ltype_name(LVAL_QEXPR));
+
+    lval *out = lval_qexpr();
+    lval_add(out, v1);
+    out = lval_join(out, v2);
+    lval_del(v);
+    return lval_hcons(out);
+}
+
+static
+lval* builtin_init(lenv *e, lval *v) {
+    LASSERT(v, v->count == 1, "'init' too many arguments");
+    if (v->cell[0]->type == LVAL_RANGE) {
+        lval *r = v->cell[0];
+        LASSERT(v, r->len != 0, "'init' cannot work on empty range");
+        lval *x = lval_range(r->start, r->step, r->len - 1);
+        lval_del(v);
+        return x;
+    }
+    LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
+            "'init' incorrect type for argument 0. Got %s, Expected %s",
+            ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(v, v->cell[0]->count != 0, "'init' cannot work on empty qexpr {}");
+    lval *x = lval_unshare(lval_take(v, 0));
+    lval_del(lval_pop(x, x->count - 1));
+    return lval_hcons(x);
+}
+
+static
+lval* builtin_len(lenv *e, lval *v) {
+    LASSERT(v, v->count == 1, "'len' too many arguments");
+    i32 t = v->cell[0]->type;
+    LASSERT(v, t == LVAL_QEXPR || t == LVAL_VEC || t == LVAL_RANGE || t == LVAL_STR
+            || t == LVAL_MAP,
+            "'len' incorrect type for argument 0. Got %s, Expected %s",
+            ltype_name(t), ltype_name(LVAL_QEXPR));
+    i64 len = t == LVAL_RANGE ? v->cell[0]->len
+            : t == LVAL_STR ? lval_str_len(v->cell[0])
+            : t == LVAL_MAP ? lmap_count(v->cell[0]->map) : v->cell[0]->count;
+    lval_del(v);
+    return lval_num(len);
+}
+
+static
+lval* builtin_def(lenv* e, lval* v) {
+    LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
+            "'def' incorrect type for argument 0. Got %s, Expected %s",
+            ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+    lval *syms = v->cell[0];
+    for (i32 i = 0; i < syms->count; i++) {
+        LASSERT(v, syms->cell[i]->type == LVAL_SYM,
+                "'def' incorrect type for symbol %d. Got %s, Expected %s",
+                i, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    LASSERT(v, syms->count == v->count - 1,
+            "'def' cannot define incorrect number of values to symbols");
+
+    for (i32 i = 0; i < syms->count; i++) {
+        lenv_put(e, syms->cell[i], v->cell[i + 1]);
+    }
+
+    lval_del(v);
+    return lval_sexpr();
+}
+
+static lval *builtin_list(lenv *e, lval *v) {
+    v->type = LVAL_QEXPR;
+    return lval_hcons(v);
+}
+
+static lval *builtin_add(lenv *e, lval *v) { return builtin_op(e, v, "+"); }
+static lval *builtin_sub(lenv *e, lval *v) { return builtin_op(e, v, "-"); }
+static lval *builtin_mul(lenv *e, lval *v) { return builtin_op(e, v, "*"); }
+static lval *builtin_div(lenv *e, lval *v) { return builtin_op(e, v, "/"); }
+
+static
+i32 lvec_code(char *op) {
+    switch (op[0]) {
+        case '+': return VEC_ADD;
+        case '-': return VEC_SUB;
+        case '*': return VEC_MUL;
+        case '/': return VEC_DIV;
+        case '<': return op[1] == '=' ? VEC_LE : VEC_LT;
+        case '>': return op[1] == '=' ? VEC_GE : VEC_GT;
+        case '=': return VEC_EQ;
+        default:  return VEC_NE;
+    }
+}
+
+// Element type `v` contributes to a vector operation.
+static
+i32 lvec_elem(lval *v) {
+    if (v->type == LVAL_VEC) return v->elem;
+    return v->type == LVAL_FLT ? LVAL_FLT : LVAL_NUM;
+}
+
+// Returns the elements of operand `v` as type `elem`. A scalar is stored
+// in `scalar` and broadcast by the kernels, integer vectors read as floats
+// are widened into `*wide`, which the caller frees.
+static
+const void* lvec_operand(lval *v, i32 elem, void *scalar, void **wide) {
+    *wide = NULL;
+    if (v->type == LVAL_VEC) {
+        if (v->elem == elem) return v->ints;
+        f64 *w = *wide = malloc(sizeof(f64) * (v->count ? v->count : 1));
+        for (i32 i = 0; i < v->count; i++) { w[i] = (f64)v->ints[i]; }
+        return w;
+    }
+    if (elem == LVAL_FLT) {
+        *(f64 *)scalar = lval_to_f64(v);
+    } else {
+        *(i64 *)scalar = v->num;
+    }
+    return scalar;
+}
+
+static lval* builtin_cmp(lenv *e, lval *v, char *op);
+
+// Tests the relation `code` between the numbers `x` and `y`. The scalar
+// kernels give the comparison semantics for one element.
+static
+i64 lnum_cmp(i32 code, lval *x, lval *y) {
+    i64 r;
+    if (x->type == LVAL_FLT || y->type == LVAL_FLT) {
+        f64 a = lval_to_f64(x), b = lval_to_f64(y);
+        vec_f64_cmp(code, &a, FALSE, &b, FALSE, &r, 1);
+    } else if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+        vec_i64_cmp(code, &x->num, FALSE, &y->num, FALSE, &r, 1);
+    } else {
+        bignum *a = x->type == LVAL_BIG ? x->big : bn_from_i64(x->num);
+        bignum *b = y->type == LVAL_BIG ? y->big : bn_from_i64(y->num);
+        i64 c = bn_cmp(a, b), zero = 0;
+        vec_i64_cmp(code, &c, FALSE, &zero, FALSE, &r, 1);
+        if (a != x->big) { bn_free(a); }
+        if (b != y->big) { bn_free(b); }
+    }
+    return r;
+}
+
+// Applies `op` element-wise to `x` and `y`, consuming both. Scalars are
+// broadcast against vectors and integer vectors are widened to floats
+// next to a float operand. Comparisons give integer vectors of 0 and 1.
+static
+lval* lvec_binop(lenv *e, char *op, lval *x, lval *y) {
+    i32 code = lvec_code(op);
+    b8 cmp = code >= VEC_LT;
+    if (x->type != LVAL_VEC && y->type != LVAL_VEC) {
+        lval *args = lval_add(lval_add(lval_sexpr(), x), y);
+        return cmp ? builtin_cmp(e, args, op) : builtin_op(e, args, op);
+    }
+
+    i32 elem = lvec_elem(x) == LVAL_FLT || lvec_elem(y) == LVAL_FLT ? LVAL_FLT : LVAL_NUM;
+    lval *err = NULL;
+    if (x->type == LVAL_VEC && y->type == LVAL_VEC && x->count != y->count) {
+        err = lval_err("vector length mismatch, %i and %i", x->count, y->count);
+    } else if (elem == LVAL_NUM && (x->type == LVAL_BIG || y->type == LVAL_BIG)) {
+        err = lval_err("vector element overflow");
+    }
+    if (err) {
+        lval_del(x); lval_del(y);
+        return err;
+    }
+
+    i32 n = x->type == LVAL_VEC ? x->count : y->count;
+    b8 xv = x->type == LVAL_VEC, yv = y->type == LVAL_VEC;
+    union { i64 num; f64 flt; } xs, ys;
+    void *xw, *yw;
+    const void *a = lvec_operand(x, elem, &xs, &xw);
+    const void *b = lvec_operand(y, elem, &ys, &yw);
+
+    lval *out = lval_vec(cmp ? LVAL_NUM : elem, n);
+    b8 ok = TRUE;
+    if (cmp && elem == LVAL_FLT) {
+        vec_f64_cmp(code, a, xv, b, yv, out->ints, n);
+    } else if (cmp) {
+        vec_i64_cmp(code, a, xv, b, yv, out->ints, n);
+    } else if (elem == LVAL_FLT) {
+        vec_f64_arith(code, a, xv, b, yv, out->flts, n);
+    } else {
+        ok = vec_i64_arith(code, a, xv, b, yv, out->ints, n);
+    }
+
+    free(xw); free(yw);
+    lval_del(x); lval_del(y);
+    if (!ok) {
+        lval_del(out);
+        return lval_err(code == VEC_DIV ? "division by zero or overflow in vector"
+                                        : "vector element overflow");
+    }
+    return out;
+}
+
+// Arithmetic with at least one vector among the operands, folded left to
+// right like builtin_op.
+static
+lval* lval_vec_op(lenv *e, lval *v, char *op) {
+    for (i32 i = 0; i < v->count; i++) {
+        i32 t = v->cell[i]->type;
+        if (t != LVAL_NUM && t != LVAL_BIG && t != LVAL_FLT && t != LVAL_VEC) {
+            lval_del(v);
+            return lval_err("Cannot operate on non-number!");
+        }
+    }
+
+    lval *acc = lval_pop(v, 0);
+    if (op[0] == '-' && v->count == 0) {
+        acc = lvec_binop(e, op, lval_num(0), acc);
+    }
+    while (v->count && acc->type != LVAL_ERR) {
+        acc = lvec_binop(e, op, acc, lval_pop(v, 0));
+    }
+    lval_del(v);
+    return acc;
+}
+
+// Compares two numbers, or element-wise with vectors, giving 1 or 0.
+// Strings compare by their bytes.
+static
+lval* builtin_cmp(lenv *e, lval *v, char *op) {
+    LASSERT_NARGS(op, v, 2);
+    if (v->cell[0]->type == LVAL_STR && v->cell[1]->type == LVAL_STR) {
+        lval *x = v->cell[0], *y = v->cell[1];
+        i64 xn = lval_str_len(x), yn = lval_str_len(y), zero = 0, r;
+        char *tx, *ty;
+        i64 c = memcmp(lval_str_bytes(x, &tx), lval_str_bytes(y, &ty), xn < yn ? xn : yn);
+        if (c == 0) { c = (xn > yn) - (xn < yn); }
+        free(tx); free(ty);
+        vec_i64_cmp(lvec_code(op), &c, FALSE, &zero, FALSE, &r, 1);
+        lval_del(v);
+        return lval_num(r);
+    }
+    if (v->cell[0]->type == LVAL_MAP && v->cell[1]->type == LVAL_MAP) {
+        b8 ne = strcmp(op, "!=") == 0;
+        LASSERT(v, ne || strcmp(op, "==") == 0, "Cannot order maps!");
+        b8 eq = lval_eq(v->cell[0], v->cell[1]);
+        lval_del(v);
+        return lval_num(eq != ne);
+    }
+
+    b8 vec = FALSE;
+    for (i32 i = 0; i < v->count; i++) {
+        i32 t = v->cell[i]->type;
+        LASSERT(v, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLT || t == LVAL_VEC,
+                "Cannot compare non-number!");
+        vec |= t == LVAL_VEC;
+    }
+    if (vec) {
+        lval *x = lval_pop(v, 0), *y = lval_pop(v, 0);
+        lval_del(v);
+        return lvec_binop(e, op, x, y);
+    }
+
+    i64 r = lnum_cmp(lvec_code(op), v->cell[0], v->cell[1]);
+    lval_del(v);
+    return lval_num(r);
+}
+
+static lval *builtin_lt(lenv *e, lval *v) { return builtin_cmp(e, v, "<");  }
+static lval *builtin_gt(lenv *e, lval *v) { return builtin_cmp(e, v, ">");  }
+static lval *builtin_le(lenv *e, lval *v) { return builtin_cmp(e, v, "<="); }
+static lval *builtin_ge(lenv *e, lval *v) { return builtin_cmp(e, v, ">="); }
+static lval *builtin_eq(lenv *e, lval *v) { return builtin_cmp(e, v, "=="); }
+static lval *builtin_ne(lenv *e, lval *v) { return builtin_cmp(e, v, "!="); }
+
+// Exact sum or product of an integer vector whose i64 reduction overflowed.
+static
+lval* lvec_reduce_big(lval *v, b8 mul) {
+    bignum *acc = bn_from_i64(mul ? 1 : 0);
+    for (i32 i = 0; i < v->count; i++) {
+        bignum *x = bn_from_i64(v->ints[i]);
+        bignum *r = mul ? bn_mul(acc, x) : bn_add(acc, x);
+        bn_free(x); bn_free(acc);
+        acc = r;
+    }
+    return lval_big(acc);
+}
+
+static
+lval* lvec_reduce(lval *v, b8 mul) {
+    if (v->elem == LVAL_FLT) {
+        return lval_flt(mul ? vec_f64_prod(v->flts, v->count) : vec_f64_sum(v->flts, v->count));
+    }
+    i64 r;
+    b8 ok = mul ? vec_i64_prod(v->ints, v->count, &r) : vec_i64_sum(v->ints, v->count, &r);
+    return ok ? lval_num(r) : lvec_reduce_big(v, mul);
+}
+
+// Reduces the Q-expression or vector argument of `func` with + or *. The
+// elements of a list go through builtin_op in one pass, vectors through
+// the SIMD kernels.
+static
+lval* builtin_reduce(lenv *e, lval *v, char *func, char *op) {
+    LASSERT_NARGS(func, v, 1);
+    i32 t = v->cell[0]->type;
+    LASSERT(v, t == LVAL_QEXPR || t == LVAL_VEC || t == LVAL_RANGE,
+            "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+            func, ltype_name(t), ltype_name(LVAL_QEXPR));
+
+    lval *x = lval_take(v, 0);
+    if (x->type == LVAL_RANGE) {
+        lval *r = op[0] == '*' ? lrange_product(x) : lrange_sum(x);
+        lval_del(x);
+        return r;
+    }
+    if (x->type == LVAL_VEC) {
+        lval *r = lvec_reduce(x, op[0] == '*');
+        lval_del(x);
+        return r;
+    }
+    if (x->count == 0) {
+        lval_del(x);
+        return lval_num(op[0] == '*' ? 1 : 0);
+    }
+    // builtin_op only reads its arguments, shared lists are fine as they are.
+    return builtin_op(e, x, op);
+}
+
+static lval *builtin_sum(lenv *e, lval *v)     { return builtin_reduce(e, v, "sum", "+"); }
+static lval *builtin_product(lenv *e, lval *v) { return builtin_reduce(e, v, "product", "*"); }
+
+static
+lval* builtin_minmax(lenv *e, lval *v, char *func, b8 max) {
+    LASSERT_NARGS(func, v, 1);
+    lval *x = v->cell[0];
+    LASSERT(v, x->type == LVAL_QEXPR || x->type == LVAL_VEC || x->type == LVAL_RANGE,
+            "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+            func, ltype_name(x->type), ltype_name(LVAL_QEXPR));
+    LASSERT(v, x->type == LVAL_RANGE ? x->len != 0 : x->count != 0,
+            "Function '%s' passed {} for argument 0.", func);
+
+    lval *r;
+    if (x->type == LVAL_RANGE) {
+        r = lval_num((x->step > 0) == max ? lrange_last(x) : x->start);
+    } else if (x->type == LVAL_VEC) {
+        r = x->elem == LVAL_FLT ? lval_flt(vec_f64_minmax(x->flts, x->count, max))
+                                : lval_num(vec_i64_minmax(x->ints, x->count, max));
+    } else {
+        lval *m = x->cell[0];
+        for (i32 i = 0; i < x->count; i++) {
+            i32 t = x->cell[i]->type;
+            LASSERT(v, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLT,
+                    "Cannot compare non-number!");
+            if (lnum_cmp(max ? VEC_GT : VEC_LT, x->cell[i], m)) { m = x->cell[i]; }
+        }
+        r = lval_copy(m);
+    }
+    lval_del(v);
+    return r;
+}
+
+static lval *builtin_min(lenv *e, lval *v) { return builtin_minmax(e, v, "min", FALSE); }
+static lval *builtin_max(lenv *e, lval *v) { return builtin_minmax(e, v, "max", TRUE); }
+
+static
+lval* builtin_mean(lenv *e, lval *v) {
+    LASSERT_NARGS("mean", v, 1);
+    lval *x = v->cell[0];
+    LASSERT(v, x->type == LVAL_QEXPR || x->type == LVAL_VEC || x->type == LVAL_RANGE,
+            "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+            "mean", ltype_name(x->type), ltype_name(LVAL_QEXPR));
+    LASSERT(v, x->type == LVAL_RANGE ? x->len != 0 : x->count != 0,
+            "Function '%s' passed {} for argument %i.", "mean", 0);
+
+    f64 n = x->type == LVAL_RANGE ? x->len : x->count;
+    lval *sum = builtin_sum(e, v);
+    if (sum->type == LVAL_ERR) return sum;
+    LASSERT(sum, sum->type != LVAL_VEC, "'mean' can only average numbers, not vectors");
+
+    f64 r = lval_to_f64(sum) / n;
+    lval_del(sum);
+    return lval_flt(r);
+}
+
+// Packs numbers, given as arguments or as one Q-expression or range, into
+// a vector of integers, or of floats if any of them is one.
+static
+lval* builtin_vec(lenv *e, lval *v) {
+    if (v->count == 1 && v->cell[0]->type == LVAL_RANGE) {
+        lval *r = v->cell[0];
+        LASSERT(v, r->len <= INT32_MAX, "'vec' range is too long");
+        lval *out = lval_vec(LVAL_NUM, (i32)r->len);
+        for (i32 i = 0; i < out->count; i++) { out->ints[i] = lrange_at(r, i); }
+        lval_del(v);
+        return out;
+    }
+    lval *q = v->count == 1 && v->cell[0]->type == LVAL_QEXPR ? v->cell[0] : v;
+    i32 elem = LVAL_NUM;
+    for (i32 i = 0; i < q->count; i++) {
+        i32 t = q->cell[i]->type;
+        LASSERT(v, t == LVAL_NUM || t == LVAL_FLT,
+                "'vec' incorrect type for element %i. Got %s, Expected %s",
+                i, ltype_name(t), ltype_name(LVAL_NUM));
+        if (t == LVAL_FLT) { elem = LVAL_FLT; }
+    }
+
+    lval *out = lval_vec(elem, q->count);
+    for (i32 i = 0; i < q->count; i++) {
+        if (elem == LVAL_FLT) {
+            out->flts[i] = lval_to_f64(q->cell[i]);
+        } else {
+            out->ints[i] = q->cell[i]->num;
+        }
+    }
+    lval_del(v);
+    return out;
+}
+
+static
+lval *builtin_var(lenv *e, lval *a, char *func) {
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval *syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++)
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+                "Function '%s' cannot define non-symbol. "
+                "Got %s, Expected %s.",
+                func,
+                ltype_name(syms->cell[i]->type),
+                ltype_name(LVAL_SYM));
+
+    LASSERT(a, (syms->count == a->count - 1),
+            "Function '%s' passed too many arguments for symbols. "
+            "Got %i, Expected %i.",
+            func, syms->count, a->count - 1);
+
+    for (int i = 0; i < syms->count; i++) {
+        if (strcmp(func, "def") == 0)
+            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+
+        if (strcmp(func, "=") == 0)
+            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+static
+lval* builtin_put(lenv* e, lval* a) {
+  return builtin_var(e, a, "=");
+}
+
+// Returns the index of the guard on `sym`, or -1 if it isn't guarded.
+static
+i32 lenv_guard_find(const char *sym) {
+    if (!(lenv_guard_mask & (1ULL << (lsym_hash(sym) & 63)))) return -1;
+    for (i32 i = 0; i < lenv_guard_count; i++) {
+        if (strcmp(lenv_guard_syms[i], sym) == 0) return i;
+    }
+    return -1;
+}
+
+// Gives the guard `i` a new version, its symbol was just bound.
+static
+void lenv_bump(i32 i) {
+    lenv_epoch = atomic_fetch_add(&lenv_epoch_source, 1) + 1;
+    lenv_guard_vers[i] = lenv_epoch;
+}
+
+// Guards `sym`, recording it in the body being optimized, if any.
+// Returns the index of the guard.
+static
+i32 lenv_guard(const char *sym) {
+    i32 i = lenv_guard_find(sym);
+    if (i < 0) {
+        i = lenv_guard_count++;
+        lenv_guard_syms = realloc(lenv_guard_syms, sizeof(char *) * lenv_guard_count);
+        lenv_guard_vers = realloc(lenv_guard_vers, sizeof(u64) * lenv_guard_count);
+        lenv_guard_syms[i] = (char *)malloc(strlen(sym) + 1);
+        strcpy(lenv_guard_syms[i], sym);
+        lenv_guard_vers[i] = atomic_fetch_add(&lenv_epoch_source, 1) + 1;
+        lenv_guard_mask |= 1ULL << (lsym_hash(sym) & 63);
+    }
+    if (lenv_guard_into) { lopt_depend(lenv_guard_into, i); }
+    return i;
+}
+
+// Copies the epoch and guards of the calling thread into `g`.
+static
+void lguards_save(lguards *g) {
+    g->epoch = lenv_epoch;
+    g->mask = lenv_guard_mask;
+    g->count = lenv_guard_count;
+    g->syms = malloc(sizeof(char *) * (lenv_guard_count ? lenv_guard_count : 1));
+    g->vers = malloc(sizeof(u64) * (lenv_guard_count ? lenv_guard_count : 1));
+    for (i32 i = 0; i < lenv_guard_count; i++) {
+        g->syms[i] = (char *)malloc(strlen(lenv_guard_syms[i]) + 1);
+        strcpy(g->syms[i], lenv_guard_syms[i]);
+        g->vers[i] = lenv_guard_vers[i];
+    }
+}
+
+// Exchanges the epoch and guards of the calling thread with `g`.
+static
+void lguards_swap(lguards *g) {
+    lguards t = { lenv_epoch, lenv_guard_mask, lenv_guard_count, lenv_guard_syms, lenv_guard_vers };
+    lenv_epoch = g->epoch;
+    lenv_guard_mask = g->mask;
+    lenv_guard_count = g->count;
+    lenv_guard_syms = g->syms;
+    lenv_guard_vers = g->vers;
+    *g = t;
+}
+
+static
+void lguards_free(lguards *g) {
+    for (i32 i = 0; i < g->count; i++) { free(g->syms[i]); }
+    free(g->syms);
+    free(g->vers);
+}
+
+typedef struct {
+    const char *name;
+    lbuiltin fun;
+} lpure;
+
+// Builtins without side effects, safe to run ahead of time on literals.
+static const lpure lval_pure_builtins[] = {
+    { "+",    builtin_add  },
+    { "-",    builtin_sub  },
+    { "*",    builtin_mul  },
+    { "/",    builtin_div  },
+    { "list", builtin_list },
+    { "head", builtin_head },
+    { "tail", builtin_tail },
+    { "join", builtin_join },
+    { "cons", builtin_cons },
+    { "init", builtin_init },
+    { "len",  builtin_len  },
+    { "<",    builtin_lt   },
+    { ">",    builtin_gt   },
+    { "<=",   builtin_le   },
+    { ">=",   builtin_ge   },
+    { "==",   builtin_eq   },
+    { "!=",   builtin_ne   },
+    { "sum",     builtin_sum     },
+    { "product", builtin_product },
+    { "min",     builtin_min     },
+    { "max",     builtin_max     },
+    { "mean",    builtin_mean    },
+    { "range",   builtin_range   },
+    { "concat",  builtin_concat  },
+    { "substr",  builtin_substr  },
+    { "find",    builtin_find    },
+};
+
+static
+b8 lval_is_literal(lval *v) {
+    return v->type == LVAL_NUM || v->type == LVAL_BIG || v->type == LVAL_FLT
+        || v->type == LVAL_QEXPR || v->type == LVAL_RANGE || v->type == LVAL_STR;
+}
+
+static
+const lpure* lval_pure_lookup(const char *sym) {
+    for (u64 i = 0; i < sizeof(lval_pure_builtins) / sizeof(lpure); i++) {
+        if (strcmp(lval_pure_builtins[i].name, sym) == 0) {
+            return &lval_pure_builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// Resolves `sym` to a pure builtin if it is still bound to the original
+// builtin in `e` and isn't shadowed by one of `formals`.
+static
+lbuiltin lval_pure_resolve(lenv *e, lval *formals, lval *sym) {
+    if (sym->type != LVAL_SYM) return NULL;
+
+    const lpure *p = lval_pure_lookup(sym->sym);
+    if (!p) return NULL;
+
+    for (i32 i = 0; formals && i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, sym->sym) == 0) return NULL;
+    }
+
+    lval *f = lenv_get(e, sym);
+    b8 same = f->type == LVAL_FUN && f->fun == p->fun;
+    lval_del(f);
+    if (!same) return NULL;
+
+    lenv_guard(p->name);
+    return p->fun;
+}
+
+static
+b8 lval_calls(lval *v, const char *sym) {
+    if (v->type != LVAL_SEXPR) return FALSE;
+    if (v->count && v->cell[0]->type == LVAL_SYM
+            && strcmp(v->cell[0]->sym, sym) == 0) {
+        return TRUE;
+    }
+    for (i32 i = 0; i < v->count; i++) {
+        if (lval_calls(v->cell[i], sym)) return TRUE;
+    }
+    return FALSE;
+}
+
+// Checks whether `v`, part of the code `code`, rebinds through 'def' or
+// '=' a symbol that `code` calls, in which case optimizing ahead of time
+// would be wrong.
+static
+b8 lval_rebinds(lval *code, lval *v) {
+    if (v->type != LVAL_SEXPR) return FALSE;
+
+    if (v->count > 1 && v->cell[0]->type == LVAL_SYM
+            && v->cell[1]->type == LVAL_QEXPR
+            && (strcmp(v->cell[0]->sym, "def") == 0
+                || strcmp(v->cell[0]->sym, "=") == 0)) {
+        lval *syms = v->cell[1];
+        for (i32 i = 0; i < syms->count; i++) {
+            if (syms->cell[i]->type == LVAL_SYM
+                    && lval_calls(code, syms->cell[i]->sym)) {
+                return TRUE;
+            }
+        }
+    }
+
+    for (i32 i = 0; i < v->count; i++) {
+        if (lval_rebinds(code, v->cell[i])) return TRUE;
+    }
+    return FALSE;
+}
+
+static
+i32 lval_size(lval *v) {
+    i32 n = 1;
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (i32 i = 0; i < v->count; i++) { n += lval_size(v->cell[i]); }
+    }
+    return n;
+}
+
+// Checks whether calling `fun` on the literals `args` costs time or memory
+// in proportion to a range rather than to the code: joining one, or taking
+// the product of one, builds every element. Those are left for run time.
+static
+b8 lval_fold_unbounded(lbuiltin fun, lval *args) {
+    if (fun != builtin_join && fun != builtin_head && fun != builtin_tail
+            && fun != builtin_init && fun != builtin_product) {
+        return FALSE;
+    }
+    for (i32 i = 0; i < args->count; i++) {
+        if (args->cell[i]->type == LVAL_RANGE) return TRUE;
+    }
+    return FALSE;
+}
+
+// Merges the leading integer literal operands of an arithmetic call, e.g.
+// (* 60 60 x) -> (* 3600 x). Arithmetic runs left to right and may turn
+// into float arithmetic at any operand, so later literals can't be moved.
+static
+lval* lval_fold_partial(lenv *e, lval *v, lbuiltin fun, i32 *folds) {
+    if (fun != builtin_add && fun != builtin_mul && fun != builtin_sub) return v;
+
+    i32 n = 1;
+    while (n < v->count && (v->cell[n]->type == LVAL_NUM || v->cell[n]->type == LVAL_BIG)) n++;
+    if (n < 3) return v;
+
+    lval *args = lval_sexpr();
+    for (i32 i = 1; i < n; i++) {
+        lval_add(args, lval_pop(v, 1));
+    }
+
+    lval *r = fun(e, args);
+    lval_add(v, r);
+    memmove(&v->cell[2], &v->cell[1], sizeof(lval*) * (v->count - 2));
+    v->cell[1] = r;
+    (*folds)++;
+    return v;
+}
+
+static
+lval* lval_fold_call(lenv *e, lval *formals, lval *v, i32 *folds) {
+    if (v->count == 0) return v;
+    if (v->count == 1) {
+        if (!lval_is_literal(v->cell[0])) return v;
+        (*folds)++;
+        return lval_take(v, 0);
+    }
+
+    lbuiltin fun = lval_pure_resolve(e, formals, v->cell[0]);
+    if (!fun) return v;
+
+    for (i32 i = 1; i < v->count; i++) {
+        if (!lval_is_literal(v->cell[i])) {
+            return lval_fold_partial(e, v, fun, folds);
+        }
+    }
+
+    lval *args = lval_sexpr();
+    for (i32 i = 1; i < v->count; i++) {
+        lval_add(args, lval_copy(v->cell[i]));
+    }
+    if (lval_fold_unbounded(fun, args)) {
+        lval_del(args);
+        return v;
+    }
+
+    // Errors are left for the evaluator to raise when the code actually runs,
+    // and large lists to build then rather than to sit in the code.
+    lval *r = fun(e, args);
+    if (r->type == LVAL_ERR
+            || (r->type == LVAL_QEXPR && lval_size(r) > LVAL_FOLD_MAX)) {
+        lval_del(r);
+        return v;
+    }
+
+    lval_del(v);
+    (*folds)++;
+    return r;
+}
+
+// Folds constant sub-expressions of the code `v`, consuming it. Nested
+// Q-expressions are data (or bodies folded by their own '\') and are
+// left untouched.
+static
+lval* lval_fold_expr(lenv *e, lval *formals, lval *v, i32 *folds) {
+    if (v->type != LVAL_SEXPR) return v;
+    for (i32 i = 0; i < v->count; i++) {
+        v->cell[i] = lval_fold_expr(e, formals, v->cell[i], folds);
+    }
+    return lval_fold_call(e, formals, v, folds);
+}
+
+static
+b8 lval_has_sym(lval *syms, const char *sym) {
+    for (i32 i = 0; syms && i < syms->count; i++) {
+        if (strcmp(syms->cell[i]->sym, sym) == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+static
+i32 lval_uses(lval *v, const char *sym) {
+    if (v->type == LVAL_SYM) return strcmp(v->sym, sym) == 0;
+    if (v->type != LVAL_SEXPR) return 0;
+    i32 n = 0;
+    for (i32 i = 0; i < v->count; i++) { n += lval_uses(v->cell[i], sym); }
+    return n;
+}
+
+// Adds a binding of `sym` to `v` to `e`, taking ownership of `v`.
+static
+void lenv_push(lenv *e, const char *sym, lval *v) {
+    e->count++;
+    e->syms = realloc(e->syms, sizeof(char *) * e->count);
+    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
+
+    e->vals[e->count - 1] = v;
+    e->syms[e->count - 1] = (char *)malloc(strlen(sym) + 1);
+    strcpy(e->syms[e->count - 1], sym);
+}
+
+static
+lsnap* lsnap_share(lsnap *s) {
+    atomic_fetch_add(&s->refs, 1);
+    return s;
+}
+
+static
+void lsnap_release(lsnap *s) {
+    if (atomic_fetch_sub(&s->refs, 1) != 1) return;
+    lenv_del(s->env);
+    free(s);
+}
+
+// Clones the binding of `sym` from the globals the global environment `e`
+// started from into `e`. Returns it, or NULL if it's unbound there too.
+static
+lval* lenv_fault(lenv *e, const char *sym) {
+    for (lsnap *s = e->base; s; s = s->env->base) {
+        for (i32 i = 0; i < s->env->count; i++) {
+            if (strcmp(s->env->syms[i], sym) == 0) {
+                lenv_push(e, sym, lval_clone(s->env->vals[i]));
+                return e->vals[e->count - 1];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Returns the value globally bound to `sym`, without copying it, unless
+// one of `formals` or a local environment between `e` and the root
+// shadows it.
+static
+lval* lenv_global(lenv *e, lval *formals, const char *sym) {
+    if (lval_has_sym(formals, sym)) return NULL;
+
+    for (; e->parent; e = e->parent) {
+        for (i32 i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], sym) == 0) return NULL;
+        }
+    }
+
+    for (i32 i = 0; i < e->count; i++) {
+        if (strcmp(e->syms[i], sym) == 0) return e->vals[i];
+    }
+    return e->base ? lenv_fault(e, sym) : NULL;
+}
+
+// Checks that the code `v` only calls pure builtins, so it can be
+// evaluated any number of times, in any order. Heads bound by `inner`,
+// the formals of an inlined function, are calls through arguments.
+static
+b8 lval_is_pure(lenv *e, lval *formals, lval *inner, lval *v) {
+    if (v->type != LVAL_SEXPR) return v->type != LVAL_ERR;
+    if (v->count < 2) return FALSE;
+    if (v->cell[0]->type != LVAL_SYM) return FALSE;
+    if (lval_has_sym(inner, v->cell[0]->sym)) return FALSE;
+    if (!lval_pure_resolve(e, formals, v->cell[0])) return FALSE;
+
+    for (i32 i = 1; i < v->count; i++) {
+        if (!lval_is_pure(e, formals, inner, v->cell[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+// Substitutes the arguments `args` for `formals` in the code `v`.
+static
+lval* lval_subst(lval *v, lval *formals, lval *args) {
+    if (v->type == LVAL_SYM) {
+        for (i32 i = 0; i < formals->count; i++) {
+            if (strcmp(formals->cell[i]->sym, v->sym) == 0) {
+                return lval_copy(args->cell[i + 1]);
+            }
+        }
+    }
+    if (v->type != LVAL_SEXPR) return lval_copy(v);
+
+    lval *x = lval_sexpr();
+    for (i32 i = 0; i < v->count; i++) {
+        lval_add(x, lval_subst(v->cell[i], formals, args));
+    }
+    return x;
+}
+
+// Replaces the call `v` by the body of the callee when that is a small
+// global lambda whose body and arguments are pure. Since the inlined body
+// only calls builtins it can't recurse, and since it doesn't bind anything
+// evaluating it in the caller's environment is equivalent under dynamic
+// scoping.
+static
+lval* lval_inline_call(lenv *e, lval *formals, lval *v, i32 *inlines) {
+    if (v->count < 2 || v->cell[0]->type != LVAL_SYM) return v;
+
+    lval *g = lenv_global(e, formals, v->cell[0]->sym);
+    if (!g || g->type != LVAL_FUN || g->fun) return v;
+    if (g->env->count || g->formals->count != v->count - 1) return v;
+
+    lval *body = lval_body(e, g);
+    if (lval_size(body) > LVAL_INLINE_MAX) return v;
+
+    lval *code = lval_copy(body);
+    code->type = LVAL_SEXPR;
+
+    b8 ok = lval_is_pure(e, formals, g->formals, code);
+    for (i32 i = 0; ok && i < g->formals->count; i++) {
+        lval *arg = v->cell[i + 1];
+        ok = lval_is_pure(e, formals, NULL, arg)
+            && (lval_is_literal(arg) || lval_uses(code, g->formals->cell[i]->sym));
+    }
+
+    lval *x = ok ? lval_subst(code, g->formals, v) : NULL;
+    lval_del(code);
+    if (!x || lval_size(x) > LVAL_INLINE_MAX * 4) {
+        if (x) { lval_del(x); }
+        return v;
+    }
+
+    // What the inlined body was optimized on, the caller relies on too.
+    lenv_guard(v->cell[0]->sym);
+    if (g->opt && body == g->opt->body && lenv_guard_into) {
+        for (i32 i = 0; i < g->opt->count; i++) {
+            lopt_depend(lenv_guard_into, g->opt->guards[i]);
+        }
+    }
+    lval_del(v);
+    (*inlines)++;
+    return x;
+}
+
+static
+lval* lval_inline_expr(lenv *e, lval *formals, lval *v, i32 *inlines) {
+    if (v->type != LVAL_SEXPR) return v;
+    for (i32 i = 0; i < v->count; i++) {
+        v->cell[i] = lval_inline_expr(e, formals, v->cell[i], inlines);
+    }
+    return lval_inline_call(e, formals, v, inlines);
+}
+
+static
+lval* lval_optimize_body(lenv *e, lval *formals, lval *body, i32 *changes) {
+    body->type = LVAL_SEXPR;
+    if (lval_rebinds(body, body)) {
+        body->type = LVAL_QEXPR;
+        return body;
+    }
+
+    lval *r = lval_inline_expr(e, formals, body, changes);
+    r = lval_fold_expr(e, formals, r, changes);
+    if (r->type == LVAL_SEXPR) {
+        r->type = LVAL_QEXPR;
+        return r;
+    }
+    return lval_add(lval_qexpr(), r);
+}
+
+static
+lopt* lopt_new(void) {
+    lopt *o = calloc(1, sizeof(lopt));
+    o->refs = 1;
+    return o;
+}
+
+static
+void lopt_release(lopt *o) {
+    if (--o->refs) return;
+    if (o->body) { lval_release(o->body); }
+    free(o->guards);
+    free(o->vers);
+    free(o);
+}
+
+// Copy of `o` for another thread. Its guards started out as a copy of
+// these, and versions are never reused, so the body stays valid there
+// until one of them is rebound.
+static
+lopt* lopt_clone(lopt *o) {
+    lopt *x = lopt_new();
+    x->retries = o->retries;
+    x->calls = o->calls;
+    if (o->body) {
+        x->body = lval_clone(o->body);
+        x->body->refs = 1;
+    }
+    x->count = o->count;
+    x->guards = malloc(sizeof(i32) * (o->count ? o->count : 1));
+    x->vers = malloc(sizeof(u64) * (o->count ? o->count : 1));
+    for (i32 i = 0; i < o->count; i++) {
+        x->guards[i] = o->guards[i];
+        x->vers[i] = o->vers[i];
+    }
+    return x;
+}
+
+// Records that the body of `o` relies on the current version of `guard`.
+static
+void lopt_depend(lopt *o, i32 guard) {
+    for (i32 i = 0; i < o->count; i++) {
+        if (o->guards[i] == guard) return;
+    }
+    o->count++;
+    o->guards = realloc(o->guards, sizeof(i32) * o->count);
+    o->vers = realloc(o->vers, sizeof(u64) * o->count);
+    o->guards[o->count - 1] = guard;
+    o->vers[o->count - 1] = lenv_guard_vers[guard];
+}
+
+// Optimizes `src` into the body of `o`, collecting the guards it relies
+// on. Returns the number of changes made.
+static
+i32 lopt_optimize(lenv *e, lval *formals, lval *src, lopt *o) {
+    lopt *outer = lenv_guard_into;
+    lenv_guard_into = o;
+    o->count = 0;
+    // Stamped first: a bump while optimizing makes the next call check.
+    o->epoch = lenv_epoch;
+
+    i32 changes = 0;
+    o->body = lval_optimize_body(e, formals, lval_copy(src), &changes);
+    o->body->refs = 1;
+    lenv_guard_into = outer;
+    return changes;
+}
+
+static
+b8 lopt_valid(lopt *o) {
+    for (i32 i = 0; i < o->count; i++) {
+        i32 g = o->guards[i];
+        if (g >= lenv_guard_count || lenv_guard_vers[g] != o->vers[i]) return FALSE;
+    }
+    o->epoch = lenv_epoch;
+    return TRUE;
+}
+
+// Returns the body the lambda `f` runs: the optimized one while the guards
+// it relies on keep their versions, optimized again from the source once
+// they don't.
+static
+lval* lval_body(lenv *e, lval *f) {
+    lopt *o = f->opt;
+    if (!o || !o->body) return f->body;
+    if (o->epoch == lenv_epoch || lopt_valid(o)) {
+        if (o->calls < LOPT_MIN_CALLS) { o->calls++; }
+        return o->body;
+    }
+
+    o->retries = o->calls < LOPT_MIN_CALLS ? o->retries + 1 : 0;
+    o->calls = 0;
+    lval_release(o->body);
+    o->body = NULL;
+    if (o->retries > LOPT_RETRIES) return f->body;
+    lopt_optimize(e, f->formals, f->body, o);
+    return o->body;
+}
+
+lval* lval_fold(lenv *e, lval *v) {
+    if (lval_rebinds(v, v)) return v;
+    i32 folds = 0;
+    return lval_fold_expr(e, NULL, v, &folds);
+}
+
+static
+lmemo* lmemo_new(i64 cap) {
+    lmemo *m = malloc(sizeof(lmemo));
+    m->refs = 1;
+    m->cap = cap;
+    m->count = 0;
+    m->nbuckets = 16;
+    m->buckets = calloc(m->nbuckets, sizeof(lmemo_entry *));
+    m->head = m->tail = NULL;
+    return m;
+}
+
+static
+void lmemo_release(lmemo *m) {
+    if (--m->refs) return;
+    for (lmemo_entry *x = m->head; x;) {
+        lmemo_entry *next = x->next;
+        lval_del(x->args); lval_del(x->result); free(x);
+        x = next;
+    }
+    free(m->buckets);
+    free(m);
+}
+
+static
+void lmemo_unlink(lmemo *m, lmemo_entry *x) {
+    if (x->prev) { x->prev->next = x->next; } else { m->head = x->next; }
+    if (x->next) { x->next->prev = x->prev; } else { m->tail = x->prev; }
+}
+
+static
+void lmemo_push(lmemo *m, lmemo_entry *x) {
+    x->prev = NULL;
+    x->next = m->head;
+    if (m->head) { m->head->prev = x; } else { m->tail = x; }
+    m->head = x;
+}
+
+static
+lmemo_entry* lmemo_find(lmemo *m, u64 hash, lval *args) {
+    lmemo_entry *x = m->buckets[hash & (m->nbuckets - 1)];
+    for (; x; x = x->chain) {
+        if (x->hash == hash && lval_eq(x->args, args)) return x;
+    }
+    return NULL;
+}
+
+static
+void lmemo_evict(lmemo *m) {
+    lmemo_entry *x = m->tail;
+    lmemo_entry **p = &m->buckets[x->hash & (m->nbuckets - 1)];
+    while (*p != x) { p = &(*p)->chain; }
+    *p = x->chain;
+
+    lmemo_unlink(m, x);
+    lval_del(x->args); lval_del(x->result); free(x);
+    m->count--;
+}
+
+static
+void lmemo_grow(lmemo *m) {
+    i64 n = m->nbuckets * 2;
+    lmemo_entry **buckets = calloc(n, sizeof(lmemo_entry *));
+    for (lmemo_entry *x = m->head; x; x = x->next) {
+        x->chain = buckets[x->hash & (n - 1)];
+        buckets[x->hash & (n - 1)] = x;
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->nbuckets = n;
+}
+
+static
+void lmemo_put(lmemo *m, u64 hash, lval *args, lval *result) {
+    lmemo_entry *x = lmemo_find(m, hash, args);
+    if (x) {
+        lval_del(args);
+        lval_del(x->result);
+        x->result = result;
+        lmemo_unlink(m, x);
+        lmemo_push(m, x);
+        return;
+    }
+
+    if (m->count == m->cap) { lmemo_evict(m); }
+    if (m->count == m->nbuckets) { lmemo_grow(m); }
+
+    x = malloc(sizeof(lmemo_entry));
+    x->hash = hash;
+    x->args = args;
+    x->result = result;
+    x->chain = m->buckets[hash & (m->nbuckets - 1)];
+    m->buckets[hash & (m->nbuckets - 1)] = x;
+    lmemo_push(m, x);
+    m->count++;
+}
+
+static _FORCE_INLINE_
+b8 lmemo_applies(lval *f, lval *args) {
+    return f->memo && f->env->count == 0 && args->count == f->formals->count;
+}
+
+// Calls the memoized `f` on a full set of arguments through `apply`,
+// answering from its cache when these arguments were seen before.
+static
+lval* lmemo_call(lenv *e, lval *f, lval *args,
+        lval* (*apply)(lenv *, lval *, lval *)) {
+    lmemo *m = f->memo;
+    u64 hash = lval_hash(args);
+
+    lmemo_entry *x = lmemo_find(m, hash, args);
+    if (x) {
+        lmemo_unlink(m, x);
+        lmemo_push(m, x);
+        lval_del(args);
+        return lval_copy(x->result);
+    }
+
+    // The call may drop the last copy of `f` by rebinding it.
+    m->refs++;
+    lval *key = lval_copy(args);
+    lval *result = apply(e, f, args);
+    if (result->type != LVAL_ERR) {
+        lmemo_put(m, hash, key, lval_copy(result));
+    } else {
+        lval_del(key);
+    }
+    lmemo_release(m);
+    return result;
+}
+
+static
+lval* builtin_memo(lenv *e, lval *v) {
+    LASSERT(v, v->count == 1 || v->count == 2,
+            "'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+            v->count);
+    LASSERT_TYPE("memo", v, 0, LVAL_FUN);
+    LASSERT(v, !v->cell[0]->fun, "'memo' cannot cache a builtin");
+    // Calls are keyed on their arguments alone, bound ones would be missed.
+    LASSERT(v, v->cell[0]->env->count == 0,
+            "'memo' cannot cache a partially applied function");
+
+    i64 cap = LMEMO_DEFAULT_CAP;
+    if (v->count == 2) {
+        LASSERT_TYPE("memo", v, 1, LVAL_NUM);
+        cap = v->cell[1]->num;
+        LASSERT(v, cap > 0, "'memo' cache size must be positive. Got %lli", cap);
+    }
+
+    lval *f = lval_pop(v, 0);
+    lval_del(v);
+    if (f->memo) { lmemo_release(f->memo); }
+    f->memo = lmemo_new(cap);
+    return f;
+}
+
+static
+lval* lval_apply(lenv* e, lval* f, lval* v) {
+    i32 given = v->count;
+    i32 total_formal = f->formals->count;
+    DBG_LOG("function call -> given %i, expected %i\n", given, total_formal);
+
+    #ifdef DEBUG_FUNC
+    for (i32 i = 0; i < v->count; i++) {
+        DBG_LOG("arg %i -> type: %s, lval = ", i, ltype_name(v->cell[i]->type));
+        lval_print(v->cell[i]); putchar('\n');
+    }
+
+    for (i32 i = 0; i < f->formals->count; i++) {
+        DBG_LOG("formal %i -> type: %s, lval = ", i, ltype_name(f->formals->cell[i]->type));
+        lval_print(f->formals->cell[i]); putchar('\n');
+    }
+    #endif
+
+    while (v->count) {
+        if (f->formals->count == 0) {
+            lval_del(v); return lval_err(
+                    "function call received too many arguments. Got %i, Expected %i",
+                    given, total_formal);
+        }
+
+        lval *sym = lval_pop(f->formals, 0);
+        lenv_move(f->env, sym, lval_pop(v, 0));
+        lval_del(sym);
+    }
+
+    lval_del(v);
+
+    if (f->formals->count == 0) {
+        // Arguments bound by an earlier partial application may shadow
+        // symbols that were guarded since.
+        for (i32 i = 0; lenv_guard_count && i < f->env->count; i++) {
+            i32 g = lenv_guard_find(f->env->syms[i]);
+            if (g >= 0) { lenv_bump(g); }
+        }
+        f->env->parent = e;
+        // Retained, the call may optimize the body again.
+        lval *body = lval_share(lval_body(f->env, f));
+        lval *r = lval_exec_sexpr(f->env, body);
+        lval_release(body);
+        return r;
+    } else {
+        return lval_copy(f);
+    }
+}
+
+lval* lval_call(lenv* e, lval* f, lval* v) {
+    if (f->fun) { return f->fun(e, v); }
+    if (lmemo_applies(f, v)) { return lmemo_call(e, f, v, lval_apply); }
+    return lval_apply(e, f, v);
+}
+
+static lenv* lenv_clone(lenv *e, lenv *parent);
+
+// Deep copy of `v` that shares nothing with it: no hash-consed values,
+// function bodies or memo caches. Specializations of executed nodes are
+// dropped, since they point at functions of the original environment.
+// Generators are bound to their thread and turn into errors.
+static
+lval* lval_clone(lval *v) {
+    switch (v->type) {
+        case LVAL_SYM: {
+            // Not lval_sym, that returns the interned symbol when hash-consing.
+            lval *x = lval_alloc(LVAL_SYM);
+            x->sym = (char *)malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            return x;
+        }
+        case LVAL_FUN: {
+            if (v->fun) return lval_copy(v);
+            lval *f = lval_lambda(lval_clone(v->formals), lval_clone(v->body));
+            lenv_del(f->env);
+            f->env = lenv_clone(v->env, NULL);
+            if (v->opt) { f->opt = lopt_clone(v->opt); }
+            if (v->memo) { f->memo = lmemo_new(v->memo->cap); }
+            return f;
+        }
+        case LVAL_GEN:
+            return lval_err("generators can't be used from another thread");
+        case LVAL_MAP: {
+            lval *x = lval_alloc(LVAL_MAP);
+            x->map = lmap_copy(v->map, lval_clone);
+            return x;
+        }
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+        case LVAL_STAGE: {
+            lval *x = lval_alloc(v->type);
+            x->count = v->count;
+            x->cell = malloc(sizeof(lval *) * v->count);
+            for (i32 i = 0; i < v->count; i++) {
+                x->cell[i] = lval_clone(v->cell[i]);
+            }
+            x->op = v->type == LVAL_STAGE ? v->op : LQ_NONE;
+            x->epoch = 0;
+            return x;
+        }
+        default:
+            return lval_copy(v);
+    }
+}
+
+static
+lenv* lenv_clone(lenv *e, lenv *parent) {
+    lenv *copy = lenv_new();
+    copy->parent = parent;
+    copy->count = e->count;
+    copy->syms = (char **)malloc(sizeof(char *) * copy->count);
+    copy->vals = (lval **)malloc(sizeof(lval *) * copy->count);
+    for (i32 i = 0; i < copy->count; i++) {
+        copy->syms[i] = (char *)malloc(strlen(e->syms[i]) + 1);
+        strcpy(copy->syms[i], e->syms[i]);
+        copy->vals[i] = lval_clone(e->vals[i]);
+    }
+    return copy;
+}
+
+// Returns a snapshot of the global environment `e`, cloning it only if
+// something was bound in `e` since the last one.
+static
+lsnap* lenv_snapshot(lenv *e) {
+    if (!e->snap) {
+        lsnap *s = malloc(sizeof(lsnap));
+        atomic_init(&s->refs, 1);
+        s->env = lenv_clone(e, NULL);
+        s->env->base = e->base ? lsnap_share(e->base) : NULL;
+        e->snap = s;
+    }
+    return lsnap_share(e->snap);
+}
+
+// Private copy of `e` for an evaluation on another thread. The frames are
+// cloned, the globals come from a snapshot and are cloned on first use.
+static
+lenv* lenv_fork(lenv *e) {
+    if (e->parent) return lenv_clone(e, lenv_fork(e->parent));
+    lenv *root = lenv_new();
+    root->base = lenv_snapshot(e);
+    return root;
+}
+
+static
+void lenv_del_chain(lenv *e) {
+    while (e) {
+        lenv *parent = e->parent;
+        lenv_del(e);
+        e = parent;
+    }
+}
+
+// Worker threads of 'pmap' and 'spawn', started on first use.
+static pool *lpool = NULL;
+static pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+
+static
+void lpool_start(void) {
+    char *threads = getenv("ALISP_THREADS");
+    lpool = pool_new(threads ? atoi(threads) : 0);
+}
+
+typedef struct lpmap_worker {
+    lenv *env;
+    lval *f;
+    lguards guards; // the worker's while it takes tasks, its thread's meanwhile
+} lpmap_worker;
+
+// A 'pmap' in progress. Every worker runs on its own snapshot of the
+// calling environment, starting from the caller's epoch and guards.
+typedef struct lpmap {
+    lpmap_worker *workers;
+    lval **items;
+    lval **results;
+    i64 count;
+    i64 chunk;
+
+    u64 epoch;
+    u64 guard_mask;
+    i32 guard_count;
+    char **guard_syms;
+    u64 *guard_vers;
+} lpmap;
+
+// Swaps in the caller's epoch and guards. The caller is a worker too, its
+// own are set aside meanwhile.
+static
+void lpmap_setup(void *ctx, i32 w) {
+    lpmap *m = ctx;
+    lguards *g = &m->workers[w].guards;
+    g->epoch = m->epoch;
+    g->mask = m->guard_mask;
+    g->count = m->guard_count;
+    g->syms = malloc(sizeof(char *) * (m->guard_count ? m->guard_count : 1));
+    g->vers = malloc(sizeof(u64) * (m->guard_count ? m->guard_count : 1));
+    for (i32 i = 0; i < m->guard_count; i++) {
+        g->syms[i] = m->guard_syms[i];
+        g->vers[i] = m->guard_vers[i];
+    }
+    lguards_swap(g);
+}
+
+// Drops the guards the worker added, the names of the others are the
+// caller's. Results optimized under them are checked again by the caller.
+static
+void lpmap_teardown(void *ctx, i32 w) {
+    lpmap *m = ctx;
+    lguards *g = &m->workers[w].guards;
+    lguards_swap(g);
+    for (i32 i = m->guard_count; i < g->count; i++) { free(g->syms[i]); }
+    free(g->syms);
+    free(g->vers);
+}
+
+static
+void lpmap_task(void *ctx, i32 w, i64 task) {
+    lpmap *m = ctx;
+    lpmap_worker *self = &m->workers[w];
+    i64 end = (task + 1) * m->chunk < m->count ? (task + 1) * m->chunk : m->count;
+    for (i64 i = task * m->chunk; i < end; i++) {
+        lval *f = lval_copy(self->f);
+        m->results[i] = lval_call(self->env, f, lval_add(lval_sexpr(), m->items[i]));
+        lval_del(f);
+    }
+}
+
+// Applies `f` to every element of `q` on the worker pool, keeping order.
+static
+lval* lval_pmap(lenv *e, lval *f, lval *q) {
+    i32 size = pool_size(lpool);
+    lpmap m = {
+        .workers = calloc(size, sizeof(lpmap_worker)),
+        .items = malloc(sizeof(lval *) * q->count),
+        .results = calloc(q->count, sizeof(lval *)),
+        .count = q->count,
+        .epoch = lenv_epoch,
+        .guard_mask = lenv_guard_mask,
+        .guard_count = lenv_guard_count,
+        .guard_syms = lenv_guard_syms,
+        .guard_vers = lenv_guard_vers,
+    };
+    m.chunk = (m.count + size * LPMAP_TASKS_PER_WORKER - 1) / (size * LPMAP_TASKS_PER_WORKER);
+    for (i32 w = 0; w < size; w++) {
+        m.workers[w].env = lenv_fork(e);
+        m.workers[w].f = lval_clone(f);
+    }
+    for (i64 i = 0; i < m.count; i++) {
+        m.items[i] = lval_clone(q->cell[i]);
+    }
+
+    pool_job job = { lpmap_setup, lpmap_teardown, lpmap_task, &m };
+    pool_run(lpool, &job, (m.count + m.chunk - 1) / m.chunk);
+
+    for (i32 w = 0; w < size; w++) {
+        lpmap_worker *x = &m.workers[w];
+        lval_del(x->f);
+        lenv_del_chain(x->env);
+    }
+
+    lval *out = lval_qexpr();
+    lval *err = NULL;
+    for (i64 i = 0; i < m.count; i++) {
+        lval *r = m.results[i];
+        if (r->type == LVAL_ERR && !err) {
+            err = r;
+            continue;
+        }
+        if (!err) { lval_add(out, lval_clone(r)); }
+        lval_del(r);
+    }
+
+    free(m.workers); free(m.items); free(m.results);
+    if (err) {
+        lval_del(out);
+        return err;
+    }
+    return lval_hcons(out);
+}
+
+// (pmap f {items}) applies `f` to each element on the worker pool and
+// returns the results in order. `f` runs on private copies of the calling
+// environment, so definitions it makes are lost.
+static
+lval* builtin_pmap(lenv *e, lval *v) {
+    LASSERT_NARGS("pmap", v, 2);
+    LASSERT_TYPE("pmap", v, 0, LVAL_FUN);
+    if (v->cell[1]->type == LVAL_RANGE) {
+        v->cell[1] = lrange_list(v->cell[1]);
+        LASSERT(v, v->cell[1]->type != LVAL_ERR, "%s", v->cell[1]->err);
+    }
+    LASSERT_TYPE("pmap", v, 1, LVAL_QEXPR);
+
+    pthread_once(&lpool_once, lpool_start);
+    lval *f = v->cell[0], *q = v->cell[1];
+    if (pool_size(lpool) > 1 && q->count > 1 && !pool_in_worker()) {
+        lval *r = lval_pmap(e, f, q);
+        lval_del(v);
+        return r;
+    }
+
+    lval *out = lval_qexpr();
+    for (i32 i = 0; i < q->count; i++) {
+        lval *g = lval_copy(f);
+        lval *r = lval_call(e, g, lval_add(lval_sexpr(), lval_copy(q->cell[i])));
+        lval_del(g);
+        if (r->type == LVAL_ERR) {
+            lval_del(out); lval_del(v);
+            return r;
+        }
+        lval_add(out, r);
+    }
+    lval_del(v);
+    return lval_hcons(out);
+}
+
+static
+lfuture* lfuture_new(lenv *e, lval *q) {
+    lfuture *f = calloc(1, sizeof(lfuture));
+    atomic_init(&f->refs, 1);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+    f->state = LFUT_QUEUED;
+    f->env = lenv_fork(e);
+    f->expr = lval_clone(q);
+    f->expr->type = LVAL_SEXPR;
+    lguards_save(&f->guards);
+    return f;
+}
+
+static
+void lfuture_release(lfuture *f) {
+    if (atomic_fetch_sub(&f->refs, 1) != 1) return;
+    if (f->env) { lenv_del_chain(f->env); }
+    if (f->expr) { lval_del(f->expr); }
+    if (f->result) { lval_del(f->result); }
+    lguards_free(&f->guards);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->done);
+    free(f);
+}
+
+// Evaluates a future the calling thread has claimed. Nothing is interned
+// meanwhile, since the result is read by whichever threads await it.
+static
+void lfuture_eval(lfuture *f) {
+    b8 hashcons = lhc_enabled;
+    lhc_enabled = FALSE;
+    lguards_swap(&f->guards);
+    lval *r = lval_eval(f->env, f->expr);
+    lguards_swap(&f->guards);
+    lhc_enabled = hashcons;
+    lenv_del_chain(f->env);
+
+    pthread_mutex_lock(&f->lock);
+    f->env = NULL;
+    f->expr = NULL;
+    f->result = r;
+    f->state = LFUT_DONE;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static
+b8 lfuture_claim(lfuture *f) {
+    pthread_mutex_lock(&f->lock);
+    b8 queued = f->state == LFUT_QUEUED;
+    if (queued) { f->state = LFUT_RUNNING; }
+    pthread_mutex_unlock(&f->lock);
+    return queued;
+}
+
+static
+void lfuture_task(void *arg) {
+    lfuture *f = arg;
+    if (lfuture_claim(f)) { lfuture_eval(f); }
+    lfuture_release(f);
+}
+
+// Returns a copy of the value of `f`, evaluating it on the calling thread
+// when no worker has started it yet.
+static
+lval* lfuture_await(lfuture *f) {
+    if (lfuture_claim(f)) { lfuture_eval(f); }
+
+    pthread_mutex_lock(&f->lock);
+    while (f->state != LFUT_DONE) {
+        pthread_cond_wait(&f->done, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return lval_hcons(lval_clone(f->result));
+}
+
+// (spawn {expr}) starts evaluating `expr` on the worker pool and returns a
+// future for its value. Like 'pmap', it works on a private copy of the
+// calling environment.
+static
+lval* builtin_spawn(lenv *e, lval *v) {
+    LASSERT_NARGS("spawn", v, 1);
+    LASSERT_TYPE("spawn", v, 0, LVAL_QEXPR);
+
+    pthread_once(&lpool_once, lpool_start);
+    lval *x = lval_alloc(LVAL_FUT);
+    x->fut = lfuture_new(e, v->cell[0]);
+    atomic_fetch_add(&x->fut->refs, 1);
+    pool_submit(lpool, lfuture_task, x->fut);
+    lval_del(v);
+    return x;
+}
+
+// (await fut) blocks until the value of a future is known and returns it.
+// A future can be awaited any number of times, from any thread.
+static
+lval* builtin_await(lenv *e, lval *v) {
+    LASSERT_NARGS("await", v, 1);
+    LASSERT_TYPE("await", v, 0, LVAL_FUT);
+    lval *r = lfuture_await(v->cell[0]->fut);
+    lval_del(v);
+    return r;
+}
+
+// Makes `v` safe to hand to another thread, consuming it. What only `v`
+// holds moves over as it is. Hash-consed nodes, closures and shared maps
+// are tied to this thread's counts and environments, those get cloned.
+static
+lval* lval_detach(lval *v) {
+    switch (v->type) {
+        case LVAL_FUN:
+            if (v->fun) return v;
+            break;
+        case LVAL_GEN:
+            lval_del(v);
+            return lval_err("generators can't be used from another thread");
+        case LVAL_MAP:
+            if (v->interned || lmap_shared(v->map)) break;
+            lmap_each(v->map, lval_detach);
+            return v;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+        case LVAL_STAGE:
+            if (v->interned) break;
+            for (i32 i = 0; i < v->count; i++) {
+                v->cell[i] = lval_detach(v->cell[i]);
+            }
+            // Cached callees point into this thread's environments.
+            v->epoch = 0;
+            return v;
+        default:
+            if (v->interned) break;
+            return v;
+    }
+    lval *x = lval_clone(v);
+    lval_del(v);
+    return x;
+}
+
+// Backs off while a channel is full or empty: spins for a while, then
+// yields and finally sleeps. Futures queued behind busy workers may be the
+// ones that would unblock it, the pool gets a spare thread for those.
+static
+void lchan_wait(i32 *spins) {
+    if (++*spins < 64) return;
+    pthread_once(&lpool_once, lpool_start);
+    pool_blocked(lpool);
+    if (*spins < 128) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 50000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// (chan n) makes a channel holding up to `n` values.
+static
+lval* builtin_chan(lenv *e, lval *v) {
+    LASSERT_NARGS("chan", v, 1);
+    LASSERT_TYPE("chan", v, 0, LVAL_NUM);
+    i64 n = v->cell[0]->num;
+    LASSERT(v, n > 0 && n <= INT32_MAX, "'chan' capacity must be positive, got %lli", n);
+    lval *x = lval_alloc(LVAL_CHAN);
+    x->chan = lchan_new(n);
+    lval_del(v);
+    return x;
+}
+
+// Messages an actor handles in a row before it lets others have the worker.
+#define LACTOR_BATCH 64
+#define LACTOR_MAILBOX 1024
+
+static
+void lactor_release(lactor *a) {
+    if (atomic_fetch_sub(&a->refs, 1) != 1) return;
+    lchan_release(a->mailbox);
+    lenv_del_chain(a->env);
+    lval_del(a->f);
+    if (a->error) { lval_del(a->error); }
+    while (a->alloc.free) {
+        lval *v = a->alloc.free;
+        a->alloc.free = v->body;
+        free(v);
+    }
+    lguards_free(&a->guards);
+    free(a);
+}
+
+// Handles up to LACTOR_BATCH messages, returning whether there may be more.
+// A handler returning a function hands the next message to it, one
+// returning an error stops the actor, whose messages are dropped from then.
+static
+b8 lactor_run(lactor *a) {
+    lalloc *prev = lalloc_current;
+    lalloc_current = &a->alloc;
+    b8 hashcons = lhc_enabled;
+    lhc_enabled = FALSE;
+    lguards_swap(&a->guards);
+
+    i32 n = 0;
+    lval *m;
+    for (; n < LACTOR_BATCH && lchan_try_recv(a->mailbox, &m); n++) {
+        if (a->error) {
+            lval_del(m);
+            continue;
+        }
+        lval *r = lval_call1(a->env, a->f, m);
+        if (r->type == LVAL_ERR) {
+            a->error = r;
+            atomic_store(&a->stopped, TRUE);
+        } else if (r->type == LVAL_FUN) {
+            lval_del(a->f);
+            a->f = r;
+        } else {
+            lval_del(r);
+        }
+    }
+
+    lguards_swap(&a->guards);
+    lhc_enabled = hashcons;
+    lalloc_current = prev;
+    return n == LACTOR_BATCH;
+}
+
+// Runs an actor on a worker. Only one task per actor is ever queued or
+// running, guarded by `scheduled`; a send that finds it clear queues one.
+static
+void lactor_task(void *arg) {
+    lactor *a = arg;
+    for (;;) {
+        if (lactor_run(a)) {
+            pool_submit(lpool, lactor_task, a);
+            return;
+        }
+        atomic_store(&a->scheduled, 0);
+        // A send that still saw the flag set must be seen here, or nobody
+        // would run its message.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!lchan_count(a->mailbox) || atomic_exchange(&a->scheduled, 1)) break;
+    }
+    lactor_release(a);
+}
+
+// Queues `x` in the mailbox of `a` and makes sure the actor will run.
+// Returns NULL, or the error that stopped the actor.
+static
+lval* lactor_post(lactor *a, lval *x) {
+    for (i32 spins = 0; !lchan_try_send(a->mailbox, x); ) {
+        if (atomic_load(&a->stopped)) {
+            lval_del(x);
+            break;
+        }
+        lchan_wait(&spins);
+    }
+    if (atomic_load(&a->stopped)) {
+        // Whatever got in is dropped by the actor, like the rest.
+        return lval_copy(a->error);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_exchange(&a->scheduled, 1)) {
+        atomic_fetch_add(&a->refs, 1);
+        pthread_once(&lpool_once, lpool_start);
+        pool_submit(lpool, lactor_task, a);
+    }
+    return NULL;
+}
+
+// (actor f) starts an actor calling `f` on each message sent to it, in an
+// environment of its own copied from the calling one. Handlers run one at a
+// time, so an actor can keep state in its environment with 'def', or by
+// returning the handler for the next message. Replies go through channels
+// sent along with the messages.
+static
+lval* builtin_actor(lenv *e, lval *v) {
+    LASSERT_NARGS("actor", v, 1);
+    LASSERT_TYPE("actor", v, 0, LVAL_FUN);
+    lactor *a = calloc(1, sizeof(lactor));
+    atomic_init(&a->refs, 1);
+    atomic_init(&a->scheduled, 0);
+    atomic_init(&a->stopped, FALSE);
+    a->mailbox = lchan_new(LACTOR_MAILBOX);
+    a->env = lenv_fork(e);
+    a->f = lval_clone(v->cell[0]);
+    lguards_save(&a->guards);
+
+    lval *x = lval_alloc(LVAL_ACTOR);
+    x->actor = a;
+    lval_del(v);
+    return x;
+}
+
+// (send ch x) puts `x` in the channel, waiting for room if it's full, and
+// returns (). The value itself moves to the receiver, it isn't copied.
+// Sending to an actor puts `x` in its mailbox.
+static
+lval* builtin_send(lenv *e, lval *v) {
+    LASSERT_NARGS("send", v, 2);
+    i32 t = v->cell[0]->type;
+    LASSERT(v, t == LVAL_CHAN || t == LVAL_ACTOR,
+            "Function 'send' passed incorrect type for argument 0. Got %s, Expected %s.",
+            ltype_name(t), ltype_name(LVAL_CHAN));
+    LASSERT(v, v->cell[1]->type != LVAL_GEN, "generators can't be used from another thread");
+    lval *x = lval_detach(lval_pop(v, 1));
+    if (t == LVAL_ACTOR) {
+        lval *err = lactor_post(v->cell[0]->actor, x);
+        lval_del(v);
+        return err ? err : lval_sexpr();
+    }
+    lchan *c = v->cell[0]->chan;
+    for (i32 spins = 0; !lchan_try_send(c, x); ) { lchan_wait(&spins); }
+    lval_del(v);
+    return lval_sexpr();
+}
+
+// (recv ch) takes the oldest value out of the channel, waiting for one if
+// it's empty.
+static
+lval* builtin_recv(lenv *e, lval *v) {
+    LASSERT_NARGS("recv", v, 1);
+    LASSERT_TYPE("recv", v, 0, LVAL_CHAN);
+    lchan *c = v->cell[0]->chan;
+    lval *x;
+    for (i32 spins = 0; !lchan_try_recv(c, &x); ) { lchan_wait(&spins); }
+    lval_del(v);
+    return lval_hcons(x);
+}
+
+// Generator being run by this thread, the innermost one when a generator
+// calls 'next' on another.
+static _Thread_local lgen *lgen_current = NULL;
+static _Thread_local lgen *lgen_live = NULL;
+
+// Copies the frames of `e` below the global environment, which is shared,
+// so the generator keeps its bindings after the call that made it returns.
+static
+lenv* lenv_copy_frames(lenv *e) {
+    if (!e->parent) return e;
+    lenv *copy = lenv_copy(e);
+    copy->parent = lenv_copy_frames(e->parent);
+    return copy;
+}
+
+static
+void lgen_main(void) {
+    lgen *g = lgen_current;
+    lval *f = lval_copy(g->f);
+    lval *r = lval_call(g->env, f, lval_sexpr());
+    lval_del(f);
+    if (r->type == LVAL_ERR && !g->closing) {
+        g->value = r;
+    } else {
+        lval_del(r);
+    }
+    g->state = LGEN_DONE;
+    swapcontext(&g->self, &g->caller);
+}
+
+// Runs `g` until it yields or returns.
+static
+void lgen_resume(lgen *g) {
+    if (g->state == LGEN_NEW) {
+        g->stack = mmap(NULL, LGEN_STACK, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (g->stack == MAP_FAILED) {
+            // Finished before it started, with the error as its result.
+            g->stack = NULL;
+            g->state = LGEN_DONE;
+            g->value = lval_err("cannot allocate generator stack");
+            return;
+        }
+        mprotect(g->stack, 4096, PROT_NONE);
+        getcontext(&g->self);
+        g->self.uc_stack.ss_sp = g->stack;
+        g->self.uc_stack.ss_size = LGEN_STACK;
+        g->self.uc_link = NULL;
+        makecontext(&g->self, lgen_main, 0);
+    }
+
+    lgen *prev = lgen_current;
+    lgen_current = g;
+    g->state = LGEN_RUNNING;
+    swapcontext(&g->caller, &g->self);
+    lgen_current = prev;
+
+    if (g->state == LGEN_DONE) {
+        munmap(g->stack, LGEN_STACK);
+        g->stack = NULL;
+    }
+}
+
+// Finishes a suspended generator: its pending 'yield' returns an error and
+// so does every later one, until the body returns and frees what it holds.
+static
+void lgen_close(lgen *g) {
+    if (g->state == LGEN_SUSPENDED) {
+        g->closing = TRUE;
+        lgen_resume(g);
+    }
+    g->state = LGEN_DONE;
+    if (g->value) {
+        lval_del(g->value);
+        g->value = NULL;
+    }
+}
+
+static
+void lgen_release(lgen *g) {
+    if (--g->refs) return;
+    lgen_close(g);
+    if (g->prev) { g->prev->next = g->next; } else { lgen_live = g->next; }
+    if (g->next) { g->next->prev = g->prev; }
+
+    for (lenv *e = g->env; e != g->root; ) {
+        lenv *parent = e->parent;
+        lenv_del(e);
+        e = parent;
+    }
+    lval_del(g->f);
+    free(g);
+}
+
+// Closes the generators working in the global environment `root`, before
+// it goes away under them.
+static
+void lgen_close_all(lenv *root) {
+    for (lgen *g = lgen_live; g; g = g->next) {
+        if (g->root == root) { lgen_close(g); }
+    }
+}
+
+// (generator f) makes a generator out of the function `f`, called with no
+// arguments on the first 'next'. Each (yield x) in it suspends it, handing
+// `x` over to 'next'.
+static
+lval* builtin_generator(lenv *e, lval *v) {
+    LASSERT_NARGS("generator", v, 1);
+    LASSERT_TYPE("generator", v, 0, LVAL_FUN);
+
+    lgen *g = calloc(1, sizeof(lgen));
+    g->refs = 1;
+    g->state = LGEN_NEW;
+    g->env = lenv_copy_frames(e);
+    for (g->root = e; g->root->parent; g->root = g->root->parent);
+    g->f = lval_take(v, 0);
+    g->next = lgen_live;
+    if (lgen_live) { lgen_live->prev = g; }
+    lgen_live = g;
+
+    lval *x = lval_alloc(LVAL_GEN);
+    x->gen = g;
+    return x;
+}
+
+// (yield x) hands `x` to the 'next' that resumed the running generator
+// and suspends it until the following one. Returns ().
+static
+lval* builtin_yield(lenv *e, lval *v) {
+    LASSERT_NARGS("yield", v, 1);
+    lgen *g = lgen_current;
+    LASSERT(v, g, "'yield' called outside of a generator");
+    LASSERT(v, !g->closing, "'yield' called on a closed generator");
+
+    g->value = lval_take(v, 0);
+    g->state = LGEN_SUSPENDED;
+    swapcontext(&g->self, &g->caller);
+    if (g->closing) { return lval_err("'yield' called on a closed generator"); }
+    return lval_sexpr();
+}
+
+// Resumes `g` for its next value. Returns NULL once it's finished, or the
+// error that ended its body.
+static
+lval* lgen_pull(lgen *g) {
+    if (g->state != LGEN_DONE) { lgen_resume(g); }
+    lval *x = g->value;
+    g->value = NULL;
+    return x;
+}
+
+// (next gen) resumes a generator and returns {x} for the next value `x` it
+// yields, or {} once it's finished. An error ending the body is returned
+// once, in place of {}.
+static
+lval* builtin_next(lenv *e, lval *v) {
+    LASSERT_NARGS("next", v, 1);
+    LASSERT_TYPE("next", v, 0, LVAL_GEN);
+    lgen *g = v->cell[0]->gen;
+    LASSERT(v, g->state != LGEN_RUNNING, "'next' called on a running generator");
+
+    lval *x = lgen_pull(g);
+    if (g->state == LGEN_SUSPENDED) { x = lval_hcons(lval_add(lval_qexpr(), x)); }
+    lval_del(v);
+    return x ? x : lval_qexpr();
+}
+
+// Kinds of pipeline stages. 'map' and 'filter' hold a function, 'reduce'
+// a function and the initial value.
+enum {
+    LSTAGE_MAP,
+    LSTAGE_FILTER,
+    LSTAGE_REDUCE
+};
+
+static const char *lstage_names[] = {
+    [LSTAGE_MAP] = "map", [LSTAGE_FILTER] = "filter", [LSTAGE_REDUCE] = "reduce"
+};
+
+static
+lval* lval_call1(lenv *e, lval *f, lval *x) {
+    lval *g = lval_copy(f);
+    lval *r = lval_call(e, g, lval_add(lval_sexpr(), x));
+    lval_del(g);
+    return r;
+}
+
+// Runs the element `x` through `stages`. Unless a filter drops it, the
+// result goes into the list `*acc`, or, past a reduce stage, becomes the
+// new `*acc`. Returns an error, or NULL.
+static
+lval* lpipe_push(lenv *e, lval **stages, i32 count, lval **acc, lval *x) {
+    for (i32 i = 0; i < count; i++) {
+        lval *s = stages[i];
+        switch (s->op) {
+            case LSTAGE_MAP:
+                x = lval_call1(e, s->cell[0], x);
+                if (x->type == LVAL_ERR) return x;
+                break;
+            case LSTAGE_FILTER: {
+                lval *keep = lval_call1(e, s->cell[0], lval_copy(x));
+                if (keep->type != LVAL_NUM && keep->type != LVAL_FLT) {
+                    lval_del(x);
+                    if (keep->type == LVAL_ERR) return keep;
+                    lval *err = lval_err("'filter' predicate returned %s, Expected %s",
+                            ltype_name(keep->type), ltype_name(LVAL_NUM));
+                    lval_del(keep);
+                    return err;
+                }
+                b8 kept = keep->type == LVAL_NUM ? keep->num != 0 : keep->flt != 0;
+                lval_del(keep);
+                if (!kept) {
+                    lval_del(x);
+                    return NULL;
+                }
+                break;
+            }
+            case LSTAGE_REDUCE: {
+                lval *g = lval_copy(s->cell[0]);
+                lval *r = lval_call(e, g, lval_add(lval_add(lval_sexpr(), *acc), x));
+                lval_del(g);
+                *acc = NULL;
+                if (r->type == LVAL_ERR) return r;
+                *acc = r;
+                return NULL;
+            }
+        }
+    }
+    lval_add(*acc, x);
+    return NULL;
+}
+
+// Pulls the elements of `src` one at a time through all of `stages`, so no
+// intermediate list is ever built. Returns the list of what comes out, or
+// the value a final reduce stage accumulates.
+static
+lval* lpipe_run(lenv *e, lval *src, lval **stages, i32 count) {
+    lval *acc = count && stages[count - 1]->op == LSTAGE_REDUCE
+        ? lval_copy(stages[count - 1]->cell[1]) : lval_qexpr();
+    lval *err = NULL;
+    switch (src->type) {
+        case LVAL_QEXPR:
+            for (i32 i = 0; !err && i < src->count; i++) {
+                err = lpipe_push(e, stages, count, &acc, lval_copy(src->cell[i]));
+            }
+            break;
+        case LVAL_RANGE:
+            for (i64 i = 0; !err && i < src->len; i++) {
+                err = lpipe_push(e, stages, count, &acc, lval_num(lrange_at(src, i)));
+            }
+            break;
+        case LVAL_VEC:
+            for (i32 i = 0; !err && i < src->count; i++) {
+                lval *x = src->elem == LVAL_FLT ? lval_flt(src->flts[i]) : lval_num(src->ints[i]);
+                err = lpipe_push(e, stages, count, &acc, x);
+            }
+            break;
+        case LVAL_GEN:
+            if (src->gen->state == LGEN_RUNNING) {
+                err = lval_err("'pipe' called on a running generator");
+            }
+            while (!err && src->gen->state != LGEN_DONE) {
+                lval *x = lgen_pull(src->gen);
+                if (!x) break;
+                err = x->type == LVAL_ERR ? x : lpipe_push(e, stages, count, &acc, x);
+            }
+            break;
+    }
 
-    lval *out = lval_qexpr();
-    lval_add(out, v1);
-    out = lval_join(out, v2);
-    return out;
+    if (err) {
+        if (acc) { lval_del(acc); }
+        return err;
+    }
+    return acc->type == LVAL_QEXPR ? lval_hcons(acc) : acc;
 }
 
 static
-lval* builtin_init(lenv *e, lval *v) {
-    LASSERT(v, v->count == 1, "'init' too many arguments");
-    LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
-            "'init' incorrect type for argument 0. Got %s, Expected %s",
-            ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
-    lval *x = lval_pop(v, 0);
-    lval *out = lval_pop(x, x->count - 1);
-    lval_del(out);
-    return x;
+b8 lpipe_source(lval *v) {
+    return v->type == LVAL_QEXPR || v->type == LVAL_RANGE
+        || v->type == LVAL_VEC || v->type == LVAL_GEN;
 }
 
+// (pipe src stage...) runs the elements of a list, range, vector or
+// generator through stages made by 'map', 'filter' and 'reduce', one
+// element through all of them before the next.
 static
-lval* builtin_len(lenv *e, lval *v) {
-    LASSERT(v, v->count == 1, "'len' too many arguments");
-    LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
-            "'len' incorrect type for argument 0. Got %s, Expected %s",
+lval* builtin_pipe(lenv *e, lval *v) {
+    LASSERT(v, v->count >= 1, "'pipe' passed no arguments");
+    LASSERT(v, lpipe_source(v->cell[0]),
+            "'pipe' incorrect type for argument 0. Got %s, Expected %s",
             ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
-    i64 len = v->cell[0]->count;
+    for (i32 i = 1; i < v->count; i++) {
+        LASSERT_TYPE("pipe", v, i, LVAL_STAGE);
+        LASSERT(v, v->cell[i]->op != LSTAGE_REDUCE || i == v->count - 1,
+                "'pipe' stage %i: 'reduce' has to be the last stage", i);
+    }
+    lval *r = lpipe_run(e, v->cell[0], &v->cell[1], v->count - 1);
     lval_del(v);
-    return lval_num(len);
+    return r;
 }
 
+// (map f), (filter p) and (reduce g init) make pipeline stages. Given a
+// source as last argument as well, they run a one stage pipeline on it.
 static
-lval* builtin_def(lenv* e, lval* v) {
-    LASSERT(v, v->cell[0]->type == LVAL_QEXPR,
-            "'def' incorrect type for argument 0. Got %s, Expected %s",
-            ltype_name(v->cell[0]->type), ltype_name(LVAL_QEXPR));
+lval* builtin_stage(lenv *e, lval *v, i32 kind) {
+    const char *func = lstage_names[kind];
+    i32 nargs = kind == LSTAGE_REDUCE ? 2 : 1;
+    LASSERT(v, v->count == nargs || v->count == nargs + 1,
+            "'%s' passed incorrect number of arguments. Got %i, expected %i or %i.",
+            func, v->count, nargs, nargs + 1);
+    LASSERT(v, v->cell[0]->type == LVAL_FUN,
+            "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+            func, ltype_name(v->cell[0]->type), ltype_name(LVAL_FUN));
 
-    lval *syms = v->cell[0];
-    for (i32 i = 0; i < syms->count; i++) {
-        LASSERT(v, syms->cell[i]->type == LVAL_SYM,
-                "'def' incorrect type for symbol %d. Got %s, Expected %s",
-                i, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    lval *src = v->count > nargs ? lval_pop(v, nargs) : NULL;
+    v->type = LVAL_STAGE;
+    v->op = kind;
+    if (!src) return v;
+
+    if (!lpipe_source(src)) {
+        lval *err = lval_err("'%s' incorrect type for argument %i. Got %s, Expected %s",
+                func, nargs, ltype_name(src->type), ltype_name(LVAL_QEXPR));
+        lval_del(src); lval_del(v);
+        return err;
     }
+    lval *r = lpipe_run(e, src, &v, 1);
+    lval_del(src); lval_del(v);
+    return r;
+}
 
-    LASSERT(v, syms->count == v->count - 1,
-            "'def' cannot define incorrect number of values to symbols");
+static lval *builtin_map(lenv *e, lval *v)    { return builtin_stage(e, v, LSTAGE_MAP); }
+static lval *builtin_filter(lenv *e, lval *v) { return builtin_stage(e, v, LSTAGE_FILTER); }
+static lval *builtin_reduce_stage(lenv *e, lval *v) { return builtin_stage(e, v, LSTAGE_REDUCE); }
 
-    for (i32 i = 0; i < syms->count; i++) {
-        lenv_put(e, syms->cell[i], v->cell[i + 1]);
+// Calls the function at the head of `v`, whose cells are evaluated.
+static
+lval* lval_invoke(lenv *e, lval *v) {
+    lval *f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+        lval_del(v); lval_del(f);
+        return lval_err("S-expression does not start with a function");
     }
 
-    lval_del(v);
-    return lval_sexpr();
+    lval *result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
 }
 
-static lval *builtin_list(lenv *e, lval *v) {
-    v->type = LVAL_QEXPR;
-    return v;
+static
+lval* lval_args_err(lval *v) {
+    for (i32 i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    }
+    return NULL;
 }
 
-static lval *builtin_add(lenv *e, lval *v) { return builtin_op(e, v, "+"); }
-static lval *builtin_sub(lenv *e, lval *v) { return builtin_op(e, v, "-"); }
-static lval *builtin_mul(lenv *e, lval *v) { return builtin_op(e, v, "*"); }
-static lval *builtin_div(lenv *e, lval *v) { return builtin_op(e, v, "/"); }
+// Calls the global lambda `g` on a full set of evaluated arguments,
+// without copying it first. The body is retained since the call may
+// rebind `g` or optimize its body again.
+static
+lval* lval_enter(lenv *e, lval *g, lval *args) {
+    lval *body = lval_share(lval_body(e, g));
+
+    lenv *env = lenv_new();
+    env->parent = e;
+    for (i32 i = 0; i < args->count; i++) {
+        lenv_move(env, g->formals->cell[i], args->cell[i]);
+    }
+    args->count = 0;
+    lval_del(args);
+
+    lval *result = lval_exec_sexpr(env, body);
+    lval_release(body);
+    lenv_del(env);
+    return result;
+}
 
 static
-lval *builtin_var(lenv *e, lval *a, char *func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+lval* lval_call_known(lenv *e, lval *g, lval *args) {
+    if (g->memo) { return lmemo_call(e, g, args, lval_enter); }
+    return lval_enter(e, g, args);
+}
 
-    lval *syms = a->cell[0];
-    for (int i = 0; i < syms->count; i++)
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-                "Function '%s' cannot define non-symbol. "
-                "Got %s, Expected %s.",
-                func,
-                ltype_name(syms->cell[i]->type),
-                ltype_name(LVAL_SYM));
+static _FORCE_INLINE_
+b8 lval_is_scalar(lval *v) {
+    return v->type == LVAL_NUM || v->type == LVAL_FLT;
+}
 
-    LASSERT(a, (syms->count == a->count - 1),
-            "Function '%s' passed too many arguments for symbols. "
-            "Got %i, Expected %i.",
-            func, syms->count, a->count - 1);
+// Specializes `node`, just executed with the evaluated cells `v`, on the
+// global function its head resolved to.
+static
+void lval_quicken(lenv *e, lval *node, lval *v) {
+    lval *head = node->cell[0];
+    node->op = LQ_NONE;
+    if (head->type != LVAL_SYM) return;
 
-    for (int i = 0; i < syms->count; i++) {
-        if (strcmp(func, "def") == 0)
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+    lval *f = lenv_global(e, NULL, head->sym);
+    if (!f || f->type != LVAL_FUN) return;
 
-        if (strcmp(func, "=") == 0)
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    if (f->fun) {
+        node->op = LQ_BUILTIN;
+        node->fun = f->fun;
+        if (v->count == 3 && lval_is_scalar(v->cell[1]) && lval_is_scalar(v->cell[2])) {
+            if (f->fun == builtin_add) node->op = LQ_ADD;
+            if (f->fun == builtin_sub) node->op = LQ_SUB;
+            if (f->fun == builtin_mul) node->op = LQ_MUL;
+            if (f->fun == builtin_div) node->op = LQ_DIV;
+        }
+    } else {
+        if (f->env->count || f->formals->count != v->count - 1) return;
+        node->op = LQ_LAMBDA;
+        node->callee = f;
     }
 
-    lval_del(a);
-    return lval_sexpr();
+    node->guard = lenv_guard(head->sym);
+    node->epoch = lenv_guard_vers[node->guard];
 }
 
-static
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
+// Checks that the head of the specialized `node` still has the binding it
+// was specialized on.
+static _FORCE_INLINE_
+b8 lval_quick(lval *node) {
+    return node->guard < lenv_guard_count && lenv_guard_vers[node->guard] == node->epoch;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* v) {
-    if (f->fun) { return f->fun(e, v); }
-
-    i32 given = v->count;
-    i32 total_formal = f->formals->count;
-    DBG_LOG("function call -> given %i, expected %i\n", given, total_formal);
-
-    #ifdef DEBUG_FUNC
-    for (i32 i = 0; i < v->count; i++) {
-        DBG_LOG("arg %i -> type: %s, lval = ", i, ltype_name(v->cell[i]->type));
-        lval_print(v->cell[i]); putchar('\n');
+// Evaluates the code `node` without consuming it.
+static
+lval* lval_exec(lenv *e, lval *node) {
+    switch (node->type) {
+        case LVAL_SYM: return lenv_get(e, node);
+        case LVAL_SEXPR: return lval_exec_sexpr(e, node);
+        default: return lval_copy(node);
     }
+}
 
-    for (i32 i = 0; i < f->formals->count; i++) {
-        DBG_LOG("formal %i -> type: %s, lval = ", i, ltype_name(f->formals->cell[i]->type));
-        lval_print(f->formals->cell[i]); putchar('\n');
+static
+lval* lval_exec_args(lenv *e, lval *node) {
+    lval *args = lval_sexpr();
+    for (i32 i = 1; i < node->count; i++) {
+        lval_add(args, lval_exec(e, node->cell[i]));
     }
-    #endif
+    return args;
+}
 
-    while (v->count) {
-        if (f->formals->count == 0) {
-            lval_del(v); return lval_err(
-                    "function call received too many arguments. Got %i, Expected %i",
-                    given, total_formal);
-        }
+static
+lval* lval_exec_sexpr(lenv *e, lval *node) {
+    if (node->op != LQ_NONE && lval_quick(node)) {
+        switch (node->op) {
+            case LQ_ADD: case LQ_SUB: case LQ_MUL: case LQ_DIV: {
+                lval *x = lval_exec(e, node->cell[1]);
+                lval *y = lval_exec(e, node->cell[2]);
+                char op = lq_arith_ops[node->op];
+                if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+                    if (lnum_op(op, x->num, y->num, &x->num)) {
+                        lval_del(y);
+                        return x;
+                    }
+                } else if (lval_is_scalar(x) && lval_is_scalar(y)) {
+                    x->flt = lflt_op(op, lval_to_f64(x), lval_to_f64(y));
+                    x->type = LVAL_FLT;
+                    lval_del(y);
+                    return x;
+                } else {
+                    node->op = LQ_BUILTIN;
+                }
 
-        lval *sym = lval_pop(f->formals, 0);
-        lval *val = lval_pop(v, 0);
+                lval *args = lval_add(lval_add(lval_sexpr(), x), y);
+                lval *err = lval_args_err(args);
+                return err ? err : node->fun(e, args);
+            }
+            case LQ_BUILTIN: {
+                lval *args = lval_exec_args(e, node);
+                lval *err = lval_args_err(args);
+                return err ? err : node->fun(e, args);
+            }
+            case LQ_LAMBDA: {
+                lval *args = lval_exec_args(e, node);
+                lval *err = lval_args_err(args);
+                if (err) return err;
 
-        lenv_put(f->env, sym, val);
+                // The arguments themselves may have rebound the callee.
+                if (lval_quick(node)) {
+                    return lval_call_known(e, node->callee, args);
+                }
+                lval *f = lenv_get(e, node->cell[0]);
+                lval *v = lval_add(lval_sexpr(), f);
+                return lval_invoke(e, lval_join(v, args));
+            }
+        }
+    }
 
-        lval_del(sym); lval_del(val);
+    lval *v = lval_sexpr();
+    for (i32 i = 0; i < node->count; i++) {
+        lval_add(v, lval_exec(e, node->cell[i]));
     }
 
-    lval_del(v);
+    lval *err = lval_args_err(v);
+    if (err) return err;
 
-    if (f->formals->count == 0) {
-        f->env->parent = e;
-        return builtin_eval(f->env,
-                lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        return lval_copy(f);
-    }
+    if (v->count == 0) { return v; }
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    lval_quicken(e, node, v);
+    return lval_invoke(e, v);
 }
 
 
@@ -448,21 +3896,13 @@ lval* lval_eval_sexpr(lenv *e, lval *v) {
     for (i32 i = 0; i < v->count; i++)
         v->cell[i] = lval_eval(e, v->cell[i]);
 
-    for (int i = 0; i < v->count; i++)
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    lval *err = lval_args_err(v);
+    if (err) return err;
 
-    if (v->count == 0) { return 0; }
+    if (v->count == 0) { return v; }
     if (v->count == 1) { return lval_take(v, 0); }
 
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval_del(v); lval_del(f);
-        return lval_err("S-expression does not start with a function");
-    }
-
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    return lval_invoke(e, v);
 }
 
 static
@@ -480,9 +3920,17 @@ void lval_expr_print(char open, lval *v, char close) {
 static
 lval *lval_read_num(mpc_ast_t *t) {
     errno = 0;
-    i64 v = strtol(t->contents, NULL, 10);
+    if (strpbrk(t->contents, ".eE")) {
+        f64 v = strtod(t->contents, NULL);
+        if (errno == ERANGE && isinf(v)) {
+            return lval_err("invalid_number");
+        }
+        return lval_flt(v);
+    }
+
+    i64 v = strtoll(t->contents, NULL, 10);
     if (errno == ERANGE) {
-        return lval_err("invalid_number");
+        return lval_big(bn_from_str(t->contents));
     }
     return lval_num(v);
 }
@@ -493,6 +3941,8 @@ lenv* lenv_new(void) {
     out->count = 0;
     out->syms = NULL;
     out->vals = NULL;
+    out->base = NULL;
+    out->snap = NULL;
     return out;
 }
 
@@ -504,6 +3954,7 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin fun) {
 }
 
 void lenv_add_builtins(lenv *e) {
+    vec_init();
     lenv_add_builtin(e, "list", builtin_list);
     lenv_add_builtin(e, "head", builtin_head);
     lenv_add_builtin(e, "tail", builtin_tail);
@@ -520,7 +3971,47 @@ void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
 
+    lenv_add_builtin(e, "<",  builtin_lt);
+    lenv_add_builtin(e, ">",  builtin_gt);
+    lenv_add_builtin(e, "<=", builtin_le);
+    lenv_add_builtin(e, ">=", builtin_ge);
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_ne);
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "range", builtin_range);
+
+    lenv_add_builtin(e, "concat", builtin_concat);
+    lenv_add_builtin(e, "substr", builtin_substr);
+    lenv_add_builtin(e, "find", builtin_find);
+
+    lenv_add_builtin(e, "hashmap", builtin_hashmap);
+    lenv_add_builtin(e, "get", builtin_get);
+    lenv_add_builtin(e, "put", builtin_put_map);
+    lenv_add_builtin(e, "delete", builtin_delete);
+    lenv_add_builtin(e, "keys", builtin_keys);
+
+    lenv_add_builtin(e, "sum", builtin_sum);
+    lenv_add_builtin(e, "product", builtin_product);
+    lenv_add_builtin(e, "min", builtin_min);
+    lenv_add_builtin(e, "max", builtin_max);
+    lenv_add_builtin(e, "mean", builtin_mean);
+
     lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "await", builtin_await);
+    lenv_add_builtin(e, "chan", builtin_chan);
+    lenv_add_builtin(e, "send", builtin_send);
+    lenv_add_builtin(e, "recv", builtin_recv);
+    lenv_add_builtin(e, "actor", builtin_actor);
+    lenv_add_builtin(e, "generator", builtin_generator);
+    lenv_add_builtin(e, "yield", builtin_yield);
+    lenv_add_builtin(e, "next", builtin_next);
+    lenv_add_builtin(e, "pipe", builtin_pipe);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "reduce", builtin_reduce_stage);
 }
 
 void lenv_del(lenv* e) {
@@ -528,6 +4019,8 @@ void lenv_del(lenv* e) {
         free(e->syms[i]);
         lval_del(e->vals[i]);
     }
+    if (e->base) { lsnap_release(e->base); }
+    if (e->snap) { lsnap_release(e->snap); }
     free(e->syms); free(e->vals); free(e);
 }
 
@@ -541,9 +4034,9 @@ lval* lenv_get(lenv* e, lval* k) {
 
     if (e->parent) {
         return lenv_get(e->parent, k);
-    } else {
-        return lval_err("unbound symbol");
     }
+    lval *x = e->base ? lenv_fault(e, k->sym) : NULL;
+    return x ? lval_copy(x) : lval_err("unbound symbol");
 }
 
 lenv* lenv_copy(lenv *e) {
@@ -563,25 +4056,46 @@ lenv* lenv_copy(lenv *e) {
 }
 
 void lenv_put(lenv *e, lval *k, lval *v) {
+    lenv_move(e, k, lval_copy(v));
+}
+
+// Binds `k` to `v` in `e`, taking ownership of `v`.
+static
+void lenv_move(lenv *e, lval *k, lval *v) {
+    if (lenv_guard_count) {
+        i32 g = lenv_guard_find(k->sym);
+        if (g >= 0) { lenv_bump(g); }
+    }
+    if (e->snap) {
+        lsnap_release(e->snap);
+        e->snap = NULL;
+    }
+
     for (i32 i = 0; i < e->count; i++) {
         if (strcmp(e->syms[i], k->sym) == 0) {
             lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
+            e->vals[i] = v;
             return;
         }
     }
+    lenv_push(e, k->sym, v);
+}
 
-    e->count++;
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = (char *)malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+static
+lval* lval_read_str(mpc_ast_t *node) {
+    size_t n = strlen(node->contents) - 2;
+    char *s = malloc(n + 1);
+    memcpy(s, node->contents + 1, n);
+    s[n] = '\0';
+    s = mpcf_unescape(s);
+    lval *x = lval_str(s, strlen(s));
+    free(s);
+    return x;
 }
 
 lval* lval_read(mpc_ast_t *node) {
     if (strstr(node->tag, "number")) return lval_read_num(node);
+    if (strstr(node->tag, "string")) return lval_read_str(node);
     if (strstr(node->tag, "symbol")) return lval_sym(node->contents);
 
     lval *x = NULL;
@@ -598,25 +4112,42 @@ lval* lval_read(mpc_ast_t *node) {
         x = lval_add(x, lval_read(node->children[i]));
     }
 
-    return x;
+    return lval_hcons(x);
 }
 
 void lval_del(lval *v) {
+    if (v->interned) {
+        if (--v->refs) return;
+        lhc_remove(v);
+    }
+
     switch (v->type) {
         case LVAL_FUN: 
             if (!v->fun) {
                 lval_del(v->formals);
-                lval_del(v->body);
+                lval_release(v->body);
+                if (v->opt) { lopt_release(v->opt); }
+                if (v->memo) { lmemo_release(v->memo); }
                 lenv_del(v->env);
             }
             break;
         case LVAL_NUM: break;
+        case LVAL_FLT: break;
+        case LVAL_BIG: bn_free(v->big); break;
+        case LVAL_VEC: free(v->ints); break;
+        case LVAL_STR: if (v->str) { lstr_release(v->str); } break;
+        case LVAL_MAP: lmap_release(v->map); break;
+        case LVAL_CHAN: lchan_release(v->chan); break;
+        case LVAL_ACTOR: lactor_release(v->actor); break;
+        case LVAL_FUT: lfuture_release(v->fut); break;
+        case LVAL_GEN: lgen_release(v->gen); break;
 
         case LVAL_ERR: free(v->err); break;
         case LVAL_SYM: free(v->sym); break;
 
         case LVAL_QEXPR:
-        case LVAL_SEXPR: {
+        case LVAL_SEXPR:
+        case LVAL_STAGE: {
                              for (i32 i=0; i< v->count; i++) {
                                  lval_del((lval *)v->cell[i]);
                              }
@@ -624,6 +4155,84 @@ void lval_del(lval *v) {
                              break;
                          }
     }
+    lval_free_node(v);
+}
+
+// Prints the shortest of %.15g, %.16g and %.17g that reads back as `v`,
+// always with a '.' or an exponent so it still reads as a float. The
+// exceptions are infinities and NaN, which have no literal: they print as
+// inf, -inf and nan (whatever the sign bit of the NaN) and don't read back.
+static
+void lval_print_flt(f64 v) {
+    if (isnan(v)) { fputs("nan", stdout); return; }
+    char buf[32];
+    for (i32 prec = 15; prec <= 17; prec++) {
+        snprintf(buf, sizeof(buf), "%.*g", prec, v);
+        if (strtod(buf, NULL) == v) break;
+    }
+    if (isfinite(v) && !strpbrk(buf, ".e")) { strcat(buf, ".0"); }
+    fputs(buf, stdout);
+}
+
+static
+void lval_print_vec(lval *v) {
+    putchar('[');
+    for (i32 i = 0; i < v->count; i++) {
+        if (i) { putchar(' '); }
+        if (v->elem == LVAL_FLT) {
+            lval_print_flt(v->flts[i]);
+        } else {
+            printf("%lli", v->ints[i]);
+        }
+    }
+    putchar(']');
+}
+
+// Prints the call that makes `v`, ending one past its last element.
+static
+void lval_print_range(lval *v) {
+    i64 end = v->len ? lrange_last(v) + (v->step > 0 ? 1 : -1) : 0;
+    printf("(range %lli %lli %lli)", v->start, end, v->step);
+}
+
+static
+void lval_print_str(lval *v) {
+    char *tmp;
+    const char *s = lval_str_bytes(v, &tmp);
+    putchar('"');
+    for (i64 i = 0, n = lval_str_len(v); i < n; i++) {
+        switch (s[i]) {
+            case '"':  fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\n': fputs("\\n", stdout);  break;
+            case '\t': fputs("\\t", stdout);  break;
+            case '\r': fputs("\\r", stdout);  break;
+            default:   putchar(s[i]);          break;
+        }
+    }
+    putchar('"');
+    free(tmp);
+}
+
+static
+void lval_print_map(lval *v) {
+    printf("(hashmap");
+    lval *k, *x;
+    for (i64 i = 0; lmap_next(v->map, &i, &k, &x); ) {
+        putchar(' '); lval_print(k);
+        putchar(' '); lval_print(x);
+    }
+    putchar(')');
+}
+
+static
+void lval_print_stage(lval *v) {
+    printf("(%s ", lstage_names[v->op]);
+    for (i32 i = 0; i < v->count; i++) {
+        if (i) { putchar(' '); }
+        lval_print(v->cell[i]);
+    }
+    putchar(')');
 }
 
 void lval_print(lval *v) {
@@ -638,6 +4247,22 @@ void lval_print(lval *v) {
             break; 
         }
         case LVAL_NUM:   printf("%lli", v->num);       break;
+        case LVAL_FLT:   lval_print_flt(v->flt);       break;
+        case LVAL_VEC:   lval_print_vec(v);            break;
+        case LVAL_FUT:   printf("<future>");           break;
+        case LVAL_CHAN:  printf("<channel>");          break;
+        case LVAL_ACTOR: printf("<actor>");            break;
+        case LVAL_GEN:   printf("<generator>");        break;
+        case LVAL_RANGE: lval_print_range(v);          break;
+        case LVAL_STAGE: lval_print_stage(v);          break;
+        case LVAL_STR:   lval_print_str(v);            break;
+        case LVAL_MAP:   lval_print_map(v);            break;
+        case LVAL_BIG: {
+            char *s = bn_to_str(v->big);
+            printf("%s", s);
+            free(s);
+            break;
+        }
         case LVAL_ERR:   printf("error: %s", v->err);  break;
         case LVAL_SYM:   printf("%s",  v->sym);        break;
         case LVAL_QEXPR: lval_expr_print('{', v, '}'); break;
@@ -656,3 +4281,182 @@ lval* lval_eval(lenv *e, lval* v) {
     if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
     return v;
 }
+
+static const char *alisp_grammar =
+    " number : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                       "
+    " string : /\"(\\\\.|[^\"])*\"/ ;                                   "
+    " sexpr  : '(' <expr>* ')' ;                                        "
+    " qexpr  : '{' <expr>* '}' ;                                        "
+    " expr   : <number> | <string> | <symbol> | <sexpr> | <qexpr>;      "
+    " alisp  : /^/ <expr>* /$/ ;                                        ";
+
+// An independent interpreter. A context is used from one thread at a time
+// and values don't move between contexts; separate contexts can run on
+// separate threads without any locking.
+struct alisp_ctx {
+    lenv *env;
+    b8 use_mpc;
+    // The mpc grammar, built the first time it's used.
+    mpc_parser_t *number;
+    mpc_parser_t *symbol;
+    mpc_parser_t *string;
+    mpc_parser_t *sexpr;
+    mpc_parser_t *qexpr;
+    mpc_parser_t *expr;
+    mpc_parser_t *alisp;
+    lalloc alloc;
+    lguards guards; // swapped in while the context evaluates, on any thread
+    char *error;    // message of the last failed evaluation
+    lval *pending;  // forms of a stream parsed with mpc, not evaluated yet
+};
+
+static
+void alisp_ctx_grammar(alisp_ctx *ctx) {
+    ctx->number = mpc_new("number");
+    ctx->symbol = mpc_new("symbol");
+    ctx->string = mpc_new("string");
+    ctx->sexpr  = mpc_new("sexpr");
+    ctx->qexpr  = mpc_new("qexpr");
+    ctx->expr   = mpc_new("expr");
+    ctx->alisp  = mpc_new("alisp");
+    mpca_lang(MPCA_LANG_DEFAULT, alisp_grammar,
+            ctx->number, ctx->symbol, ctx->string, ctx->sexpr, ctx->qexpr, ctx->expr,
+            ctx->alisp);
+}
+
+alisp_ctx* alisp_ctx_new(void) {
+    alisp_ctx *ctx = calloc(1, sizeof(alisp_ctx));
+    lalloc *prev = lalloc_current;
+    lalloc_current = &ctx->alloc;
+    ctx->env = lenv_new();
+    lenv_add_builtins(ctx->env);
+    lalloc_current = prev;
+    ctx->guards.epoch = atomic_fetch_add(&lenv_epoch_source, 1) + 1;
+    return ctx;
+}
+
+void alisp_ctx_del(alisp_ctx *ctx) {
+    lalloc *prev = lalloc_current;
+    lalloc_current = NULL;
+    // Closing a generator runs the rest of its body.
+    lguards_swap(&ctx->guards);
+    lgen_close_all(ctx->env);
+    lguards_swap(&ctx->guards);
+    lenv_del(ctx->env);
+    while (ctx->alloc.free) {
+        lval *v = ctx->alloc.free;
+        ctx->alloc.free = v->body;
+        free(v);
+    }
+    lalloc_current = prev == &ctx->alloc ? NULL : prev;
+    lguards_free(&ctx->guards);
+
+    if (ctx->alisp) {
+        mpc_cleanup(7, ctx->number, ctx->symbol, ctx->string, ctx->sexpr, ctx->qexpr,
+                ctx->expr, ctx->alisp);
+    }
+    if (ctx->pending) { lval_del(ctx->pending); }
+    free(ctx->error);
+    free(ctx);
+}
+
+lenv* alisp_ctx_env(alisp_ctx *ctx) {
+    return ctx->env;
+}
+
+const char* alisp_ctx_error(alisp_ctx *ctx) {
+    return ctx->error;
+}
+
+void alisp_ctx_use_mpc(alisp_ctx *ctx, b8 enabled) {
+    ctx->use_mpc = enabled;
+}
+
+// Parses `src` with the mpc grammar, reporting errors as if it started at
+// `line` and `col` of the file.
+static
+lval* alisp_parse_mpc(alisp_ctx *ctx, const char *filename, const char *src,
+        i64 line, i64 col) {
+    if (!ctx->alisp) { alisp_ctx_grammar(ctx); }
+    mpc_result_t r;
+    if (!mpc_parse(filename, src, ctx->alisp, &r)) {
+        if (r.error->state.row == 0) { r.error->state.col += col - 1; }
+        r.error->state.row += line - 1;
+        ctx->error = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        return NULL;
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return x;
+}
+
+// Parses `src` into an S-expression of its expressions, or returns NULL
+// and sets ctx->error.
+static
+lval* alisp_parse(alisp_ctx *ctx, const char *filename, const char *src) {
+    if (!ctx->use_mpc) return lread(filename, src, strlen(src), &ctx->error);
+    return alisp_parse_mpc(ctx, filename, src, 1, 1);
+}
+
+// The next form of `in` read with the mpc grammar, like lstream_read does
+// with the reader. A form's text may hold more than one.
+static
+lval* alisp_parse_next(alisp_ctx *ctx, lstream *in) {
+    while (!ctx->pending || !ctx->pending->count) {
+        i64 len, line, col;
+        const char *form = lstream_next(in, &len, &line, &col);
+        if (!form) return NULL;
+        char *src = malloc(len + 1);
+        memcpy(src, form, len);
+        src[len] = '\0';
+        lval *x = alisp_parse_mpc(ctx, lstream_filename(in), src, line, col);
+        free(src);
+        if (!x) return NULL;
+        if (ctx->pending) { lval_del(ctx->pending); }
+        ctx->pending = x;
+    }
+    return lval_pop(ctx->pending, 0);
+}
+
+// Evaluates what was read into `x`, if anything, keeping a failure's
+// message in ctx->error.
+static
+lval* alisp_run(alisp_ctx *ctx, lval *x) {
+    if (!x) return NULL;
+    lguards_swap(&ctx->guards);
+    x = lval_eval(ctx->env, lval_fold(ctx->env, x));
+    lguards_swap(&ctx->guards);
+    if (x->type == LVAL_ERR) {
+        ctx->error = malloc(strlen(x->err) + 1);
+        strcpy(ctx->error, x->err);
+    }
+    return x;
+}
+
+lval* alisp_eval(alisp_ctx *ctx, const char *filename, const char *src) {
+    lalloc *prev = lalloc_current;
+    lalloc_current = &ctx->alloc;
+    free(ctx->error);
+    ctx->error = NULL;
+
+    lval *x = alisp_run(ctx, alisp_parse(ctx, filename, src));
+
+    lalloc_current = prev;
+    return x;
+}
+
+lval* alisp_eval_next(alisp_ctx *ctx, lstream *in) {
+    lalloc *prev = lalloc_current;
+    lalloc_current = &ctx->alloc;
+    free(ctx->error);
+    ctx->error = NULL;
+
+    // Each form is evaluated on its own, as if it were a line of its own.
+    lval *x = ctx->use_mpc ? alisp_parse_next(ctx, in) : lstream_read(in, &ctx->error);
+    x = alisp_run(ctx, x ? lval_add(lval_sexpr(), x) : NULL);
+
+    lalloc_current = prev;
+    return x;
+}
@@ -2,6 +2,10 @@
 
 #include "types.h"
 #include "mpc.h"
+#include "bignum.h"
+
+// Strings up to this many bytes are stored in the lval itself.
+#define LSTR_INLINE 23
 
 #define LASSERT(arg, cond, fmt, ...)               \
     if (!(cond))                                   \
@@ -28,24 +32,90 @@
 
 struct lval;
 struct lenv;
+struct lmemo;
+struct lopt;
+struct lsnap;
+struct lfuture;
+struct lgen;
+struct lstr;
+struct lmap;
+struct lchan;
+struct lactor;
+struct lstream;
+struct alisp_ctx;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmemo lmemo;
+typedef struct lopt lopt;
+typedef struct lsnap lsnap;
+typedef struct lfuture lfuture;
+typedef struct lgen lgen;
+typedef struct lstr lstr;
+typedef struct lmap lmap;
+typedef struct lchan lchan;
+typedef struct lactor lactor;
+typedef struct lstream lstream;
+typedef struct alisp_ctx alisp_ctx;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 struct lval {
     i32 type;
-
-    i64 num;
-    char *err;
-    char *sym;
-
-    lbuiltin fun;
-    lenv* env;
-    lval* formals;
-    lval* body;
+    i32 refs;       // function bodies and hash-consed values are shared
+
+    union {
+        i64 num;
+        f64 flt;
+        bignum *big;    // integers outside the range of `num`
+        char *err;
+        struct {    // an LVAL_RANGE: `len` integers from `start`, `step` apart
+            i64 start;
+            i64 step;
+            i64 len;
+        };
+        struct {    // an LVAL_STR of `count` bytes
+            lstr *str;                      // a longer one, shared by all copies
+            char small[LSTR_INLINE + 1];    // a shorter one, inline
+        };
+        lmap *map;      // table of an LVAL_MAP, shared until a copy changes it
+        lchan *chan;
+        lactor *actor;
+        lfuture *fut;   // evaluation started by 'spawn', shared by all copies
+        lgen *gen;      // coroutine made by 'generator', shared by all copies
+        struct {    // an LVAL_VEC of `count` packed elements
+            i32 elem;   // LVAL_NUM or LVAL_FLT
+            union {
+                i64 *ints;
+                f64 *flts;
+            };
+        };
+        struct {    // a symbol, a function, or an S-expression as code
+            union {
+                char *sym;
+                lbuiltin fun;   // a builtin, or the one an LQ_BUILTIN node calls
+            };
+            u64 epoch;  // version of the guard a node's specialization relies on
+            union {
+                struct {    // a lambda, `fun` is NULL
+                    lenv* env;
+                    lval* formals;
+                    lval* body;
+                    lopt* opt;      // optimized body, if optimizing changed it
+                    lmemo* memo;    // result cache of a function wrapped by 'memo'
+                };
+                struct {    // an S-expression, Q-expression, stage or symbol
+                    i32 op;         // specialized kind of an executed S-expression
+                                    // node, or the kind of an LVAL_STAGE
+                    i32 guard;      // index of the guard on the node's head
+                    lval* callee;   // lambda called by an LQ_LAMBDA node
+                    u64 hash;       // cached hash of a hash-consed value
+                };
+            };
+        };
+    };
 
     i32 count;
+    b8 interned;    // hash-consed: immutable, deduplicated, counted by `refs`
     struct lval **cell;
 };
 
@@ -54,6 +124,9 @@ struct lenv {
     i32 count;
     char** syms;
     lval** vals;
+    lsnap *base;    // globals the bindings missing from a global environment
+                    // are cloned from on first use
+    lsnap *snap;    // snapshot of a global environment, until it changes
 };
 
 enum {
@@ -62,7 +135,18 @@ enum {
     LVAL_SYM,
     LVAL_FUN,   
     LVAL_SEXPR,   
-    LVAL_QEXPR
+    LVAL_QEXPR,
+    LVAL_BIG,
+    LVAL_FLT,
+    LVAL_VEC,
+    LVAL_FUT,
+    LVAL_GEN,
+    LVAL_RANGE,
+    LVAL_STAGE,
+    LVAL_STR,
+    LVAL_MAP,
+    LVAL_CHAN,
+    LVAL_ACTOR
 };
 
 lenv* lenv_new(void);
@@ -73,10 +157,43 @@ lval* lenv_get(lenv* e, lval* k);
 void lenv_add_builtin(lenv *e, char *name, lbuiltin fun);
 void lenv_add_builtins(lenv *e);
 
+lval* lval_num(i64 num);
+lval* lval_flt(f64 flt);
+lval* lval_big(bignum *big);
+lval* lval_sym(char *sym);
+lval* lval_sym_n(const char *sym, i64 len);
+lval* lval_str(const char *s, i64 len);
+lval* lval_err(char *fmt, ...);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval *v, lval *x);
+// Interns `v` when hash-consing is on, consuming it.
+lval* lval_hcons(lval *v);
 void lval_del(lval *v);
+u64 lval_hash(lval *v);
+b8 lval_eq(lval *x, lval *y);
+void lval_set_hashcons(b8 enabled);
 lval* lval_eval(lenv *e, lval *v);
+lval* lval_fold(lenv *e, lval *v);
 
 void lval_print(lval *v);
 void lval_println(lval *v);
 
 lval* lval_read(mpc_ast_t *node);
+
+alisp_ctx* alisp_ctx_new(void);
+void alisp_ctx_del(alisp_ctx *ctx);
+lenv* alisp_ctx_env(alisp_ctx *ctx);
+const char* alisp_ctx_error(alisp_ctx *ctx);
+// Makes alisp_eval parse with the mpc grammar instead of the reader.
+void alisp_ctx_use_mpc(alisp_ctx *ctx, b8 enabled);
+
+// Parses and evaluates `src`. Returns the result, which may be an error
+// value, or NULL when `src` doesn't parse. Either way alisp_ctx_error
+// tells what went wrong.
+lval* alisp_eval(alisp_ctx *ctx, const char *filename, const char *src);
+
+// Reads the next top-level form from `in` and evaluates it. Returns NULL
+// at the end of the input, or when the form doesn't parse, which only
+// leaves alisp_ctx_error set.
+lval* alisp_eval_next(alisp_ctx *ctx, lstream *in);
@@ -0,0 +1,174 @@
+// Parse time of mpca_lang grammars on deeply nested input, backtracking
+// as usual and with MPCA_LANG_PACKRAT. Alternatives sharing a prefix make
+// plain backtracking exponential in the nesting depth, the memo keeps it
+// linear. A flat list, where nothing is parsed twice, shows what the memo
+// costs when it can't help.
+
+// clock_gettime.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "mpc.h"
+
+static
+f64 now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+typedef struct grammar {
+    const char *name;
+    const char *lang;
+    // Input nested `depth` deep.
+    char* (*input)(i32 depth);
+    i32 depths[8];
+    // Deepest input plain backtracking is tried on. Past it, plain parses
+    // of the nested grammars would take hours.
+    i32 plain_max;
+} grammar;
+
+static
+char* nested(const char *open, const char *inner, const char *close, i32 depth) {
+    char *s = malloc((strlen(open) + strlen(close)) * depth + strlen(inner) + 1);
+    s[0] = '\0';
+    for (i32 i = 0; i < depth; i++) { strcat(s, open); }
+    strcat(s, inner);
+    for (i32 i = 0; i < depth; i++) { strcat(s, close); }
+    return s;
+}
+
+static
+char* sums(i32 depth) {
+    return nested("(", "1", ")", depth);
+}
+
+static
+char* pairs(i32 depth) {
+    return nested("(", "b", " . a)", depth);
+}
+
+static
+char* flat(i32 depth) {
+    char *s = malloc(2 * depth + 3);
+    i64 n = 0;
+    s[n++] = '(';
+    for (i32 i = 0; i < depth; i++) { s[n++] = 'a'; s[n++] = ' '; }
+    s[n++] = ')';
+    s[n] = '\0';
+    return s;
+}
+
+static const grammar grammars[] = {
+    { "sums",
+      " top  : /^/ <expr> /$/ ;                                   "
+      " expr : <term> '+' <expr> | <term> '-' <expr> | <term> ;   "
+      " term : '(' <expr> ')' | /[0-9]+/ ;                         ",
+      sums, { 4, 8, 10, 12, 14, 40, 80, 0 }, 12 },
+    { "dotted pairs",
+      " top   : /^/ <value> /$/ ;                        "
+      " value : <list> | <pair> | <atom> ;               "
+      " list  : '(' <value>* ')' ;                       "
+      " pair  : '(' <value> '.' <value> ')' ;            "
+      " atom  : /[a-z0-9]+/ ;                            ",
+      pairs, { 4, 8, 12, 16, 18, 40, 80, 0 }, 18 },
+    { "flat list",
+      " top   : /^/ <value> /$/ ;                        "
+      " value : <list> | <pair> | <atom> ;               "
+      " list  : '(' <value>* ')' ;                       "
+      " pair  : '(' <value> '.' <value> ')' ;            "
+      " atom  : /[a-z0-9]+/ ;                            ",
+      flat, { 1000, 10000, 100000, 0 }, 100000 },
+};
+
+typedef struct parsers {
+    mpc_parser_t *p[7];     // the first is the top rule
+} parsers;
+
+static
+parsers build(const char *lang, i32 flags) {
+    const char *names[] = { "top", "expr", "term", "value", "list", "pair", "atom" };
+    parsers ps;
+    // Every grammar is given every name, the unused ones stay undefined.
+    for (i32 i = 0; i < 7; i++) { ps.p[i] = mpc_new(names[i]); }
+    mpc_err_t *err = mpca_lang(flags, lang, ps.p[0], ps.p[1], ps.p[2], ps.p[3], ps.p[4],
+            ps.p[5], ps.p[6], NULL);
+    if (err) {
+        mpc_err_print(err);
+        exit(1);
+    }
+    return ps;
+}
+
+static
+void cleanup(parsers ps) {
+    mpc_cleanup(7, ps.p[0], ps.p[1], ps.p[2], ps.p[3], ps.p[4], ps.p[5], ps.p[6]);
+}
+
+static
+b8 ast_same(mpc_ast_t *a, mpc_ast_t *b) {
+    if (strcmp(a->tag, b->tag) || strcmp(a->contents, b->contents)) return FALSE;
+    if (a->children_num != b->children_num) return FALSE;
+    for (i32 i = 0; i < a->children_num; i++) {
+        if (!ast_same(a->children[i], b->children[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+// Seconds per parse of `src`, repeated for a while to time short ones.
+static
+f64 parse(mpc_parser_t *top, const char *src, mpc_ast_t **out) {
+    i32 runs = 0;
+    f64 start = now(), t;
+    do {
+        mpc_result_t r;
+        if (!mpc_parse("bench", src, top, &r)) {
+            mpc_err_print(r.error);
+            exit(1);
+        }
+        if (*out) { mpc_ast_delete(*out); }
+        *out = r.output;
+        runs++;
+        t = now() - start;
+    } while (t < 0.05);
+    return t / runs;
+}
+
+int main(void) {
+    for (u64 g = 0; g < sizeof(grammars) / sizeof(grammars[0]); g++) {
+        const grammar *gr = &grammars[g];
+        parsers plain = build(gr->lang, MPCA_LANG_DEFAULT);
+        parsers memo = build(gr->lang, MPCA_LANG_PACKRAT);
+
+        printf("%s\n%8s %14s %14s\n", gr->name, "depth", "backtracking", "packrat");
+        for (i32 d = 0; gr->depths[d]; d++) {
+            char *src = gr->input(gr->depths[d]);
+            mpc_ast_t *a = NULL, *b = NULL;
+            f64 tm = parse(memo.p[0], src, &b);
+            printf("%8d ", gr->depths[d]);
+            if (gr->depths[d] > gr->plain_max) {
+                printf("%14s ", "-");
+            } else {
+                f64 tp = parse(plain.p[0], src, &a);
+                printf("%11.3f ms ", tp * 1e3);
+                if (!ast_same(a, b)) {
+                    printf("\noutputs differ\n");
+                    return 1;
+                }
+                mpc_ast_delete(a);
+            }
+            printf("%11.3f ms\n", tm * 1e3);
+            mpc_ast_delete(b);
+            free(src);
+        }
+        printf("\n");
+        cleanup(plain);
+        cleanup(memo);
+    }
+    return 0;
+}
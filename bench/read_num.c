@@ -0,0 +1,128 @@
+// Integer literal throughput: lread_int against converting a copy of each
+// token with strtoll, the way numbers read through the mpc grammar are,
+// and against checking every digit for overflow on its own. Then whole
+// Q-expressions of numbers read by the reader and by the mpc grammar.
+
+// clock_gettime.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "alisp.h"
+#include "reader.h"
+
+#define COUNT  2000000
+#define ROUNDS 5
+
+static
+f64 now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Random integers of 1 to 18 digits, half of them negative, separated by
+// spaces. Token boundaries go to `starts`, one past the last too.
+static
+char* numbers(i64 count, i64 *starts) {
+    char *src = malloc(count * 21 + 1);
+    i64 n = 0;
+    for (i64 i = 0; i < count; i++) {
+        starts[i] = n;
+        if (rand() % 2) { src[n++] = '-'; }
+        i32 digits = 1 + rand() % 18;
+        src[n++] = '1' + rand() % 9;
+        for (i32 d = 1; d < digits; d++) { src[n++] = '0' + rand() % 10; }
+        src[n++] = ' ';
+    }
+    starts[count] = n;
+    src[n] = '\0';
+    return src;
+}
+
+static
+b8 convert_strtoll(const char *p, const char *end, i64 *out) {
+    char *s = malloc(end - p + 1);
+    memcpy(s, p, end - p);
+    s[end - p] = '\0';
+    errno = 0;
+    *out = strtoll(s, NULL, 10);
+    free(s);
+    return errno != ERANGE;
+}
+
+static
+b8 convert_digits(const char *p, const char *end, i64 *out) {
+    b8 neg = *p == '-';
+    i64 v = 0;
+    for (const char *d = p + neg; d < end; d++) {
+        if (__builtin_mul_overflow(v, 10, &v) || __builtin_sub_overflow(v, *d - '0', &v)) return FALSE;
+    }
+    if (!neg && v == INT64_MIN) return FALSE;
+    *out = neg ? v : -v;
+    return TRUE;
+}
+
+static
+void run(const char *name, b8 (*convert)(const char *, const char *, i64 *),
+         const char *src, const i64 *starts) {
+    f64 best = 1e9;
+    u64 sum = 0;
+    for (i32 r = 0; r < ROUNDS; r++) {
+        f64 t = now();
+        for (i64 i = 0; i < COUNT; i++) {
+            i64 v = 0;
+            convert(src + starts[i], src + starts[i + 1] - 1, &v);
+            sum += (u64)v;
+        }
+        t = now() - t;
+        if (t < best) { best = t; }
+    }
+    printf("%-16s %8.1f M numbers/s  (%llu)\n", name, COUNT / best / 1e6, sum);
+}
+
+static
+void run_eval(const char *name, b8 mpc, const char *src) {
+    alisp_ctx *ctx = alisp_ctx_new();
+    alisp_ctx_use_mpc(ctx, mpc);
+    f64 t = now();
+    lval *x = alisp_eval(ctx, "bench", src);
+    t = now() - t;
+    if (!x) {
+        printf("%-16s %s\n", name, alisp_ctx_error(ctx));
+    } else {
+        printf("%-16s %8.1f M numbers/s\n", name, x->count / t / 1e6);
+        lval_del(x);
+    }
+    alisp_ctx_del(ctx);
+}
+
+int main(void) {
+    srand(1);
+    i64 *starts = malloc(sizeof(i64) * (COUNT + 1));
+    char *src = numbers(COUNT, starts);
+
+    run("copy + strtoll", convert_strtoll, src, starts);
+    run("digit by digit", convert_digits, src, starts);
+    run("lread_int", lread_int, src, starts);
+
+    // The grammar is much slower, it gets a tenth of the numbers.
+    i64 len = starts[COUNT / 10];
+    char *qexpr = malloc(len + 3);
+    qexpr[0] = '{';
+    memcpy(qexpr + 1, src, len);
+    qexpr[len + 1] = '}';
+    qexpr[len + 2] = '\0';
+    run_eval("reader", FALSE, qexpr);
+    run_eval("mpc grammar", TRUE, qexpr);
+
+    free(qexpr);
+    free(src);
+    free(starts);
+    return 0;
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bignum.h"
+
+// Multiplications where both operands have at least this many limbs are
+// split with Karatsuba, smaller ones use the schoolbook method.
+#define BN_KARATSUBA_MIN 32
+
+static
+bignum* bn_alloc(i32 len) {
+    bignum *x = malloc(sizeof(bignum) + sizeof(u32) * (len ? len : 1));
+    x->neg = FALSE;
+    x->len = len;
+    return x;
+}
+
+static
+i32 mag_trim(const u32 *a, i32 n) {
+    while (n && !a[n - 1]) { n--; }
+    return n;
+}
+
+static
+bignum* bn_trim(bignum *x) {
+    x->len = mag_trim(x->limbs, x->len);
+    if (!x->len) { x->neg = FALSE; }
+    return x;
+}
+
+static
+i32 mag_cmp(const u32 *a, i32 an, const u32 *b, i32 bn) {
+    if (an != bn) return an < bn ? -1 : 1;
+    for (i32 i = an - 1; i >= 0; i--) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// out = a + b, with room for max(an, bn) + 1 limbs.
+static
+void mag_add(const u32 *a, i32 an, const u32 *b, i32 bn, u32 *out) {
+    if (an < bn) {
+        const u32 *t = a; a = b; b = t;
+        i32 tn = an; an = bn; bn = tn;
+    }
+
+    u64 carry = 0;
+    for (i32 i = 0; i < an; i++) {
+        carry += (u64)a[i] + (i < bn ? b[i] : 0);
+        out[i] = (u32)carry;
+        carry >>= 32;
+    }
+    out[an] = (u32)carry;
+}
+
+// out = a - b, with room for an limbs. Requires a >= b, out may be a.
+static
+void mag_sub(const u32 *a, i32 an, const u32 *b, i32 bn, u32 *out) {
+    u64 borrow = 0;
+    for (i32 i = 0; i < an; i++) {
+        u64 d = (u64)a[i] - (i < bn ? b[i] : 0) - borrow;
+        out[i] = (u32)d;
+        borrow = d >> 63;
+    }
+}
+
+// out[0, on) += t[0, tn), where the sum fits in on limbs.
+static
+void mag_add_at(u32 *out, i32 on, const u32 *t, i32 tn) {
+    u64 carry = 0;
+    for (i32 i = 0; i < on && (i < tn || carry); i++) {
+        carry += (u64)out[i] + (i < tn ? t[i] : 0);
+        out[i] = (u32)carry;
+        carry >>= 32;
+    }
+}
+
+static
+void mag_mul_school(const u32 *a, i32 an, const u32 *b, i32 bn, u32 *out) {
+    memset(out, 0, sizeof(u32) * (an + bn));
+    for (i32 i = 0; i < an; i++) {
+        u64 carry = 0;
+        for (i32 j = 0; j < bn; j++) {
+            carry += (u64)a[i] * b[j] + out[i + j];
+            out[i + j] = (u32)carry;
+            carry >>= 32;
+        }
+        out[i + bn] = (u32)carry;
+    }
+}
+
+// out = a * b, with room for an + bn limbs.
+static
+void mag_mul(const u32 *a, i32 an, const u32 *b, i32 bn, u32 *out) {
+    if (an < bn) {
+        const u32 *t = a; a = b; b = t;
+        i32 tn = an; an = bn; bn = tn;
+    }
+    if (bn < BN_KARATSUBA_MIN) {
+        mag_mul_school(a, an, b, bn, out);
+        return;
+    }
+
+    // a = a1 B^m + a0 and b = b1 B^m + b0 with B = 2^32.
+    i32 m = an / 2;
+
+    if (bn <= m) {
+        // b has no high half: a b = a0 b + a1 b B^m.
+        u32 *t = malloc(sizeof(u32) * (an - m + bn));
+        mag_mul(a, m, b, bn, out);
+        memset(out + m + bn, 0, sizeof(u32) * (an - m));
+        mag_mul(a + m, an - m, b, bn, t);
+        mag_add_at(out + m, an + bn - m, t, an - m + bn);
+        free(t);
+        return;
+    }
+
+    i32 a0n = mag_trim(a, m), b0n = mag_trim(b, m);
+    i32 a1n = an - m, b1n = bn - m;
+
+    // z0 = a0 b0 goes to out[0, 2m) and z2 = a1 b1 to out[2m, an + bn).
+    mag_mul(a, a0n, b, b0n, out);
+    memset(out + a0n + b0n, 0, sizeof(u32) * (2 * m - a0n - b0n));
+    mag_mul(a + m, a1n, b + m, b1n, out + 2 * m);
+
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2
+    i32 san = (a0n > a1n ? a0n : a1n) + 1;
+    i32 sbn = (b0n > b1n ? b0n : b1n) + 1;
+    u32 *sa = malloc(sizeof(u32) * san);
+    u32 *sb = malloc(sizeof(u32) * sbn);
+    u32 *z1 = malloc(sizeof(u32) * (san + sbn));
+    mag_add(a, a0n, a + m, a1n, sa);
+    mag_add(b, b0n, b + m, b1n, sb);
+    mag_mul(sa, san, sb, sbn, z1);
+
+    i32 z1n = san + sbn;
+    mag_sub(z1, z1n, out, mag_trim(out, 2 * m), z1);
+    mag_sub(z1, z1n, out + 2 * m, mag_trim(out + 2 * m, a1n + b1n), z1);
+    mag_add_at(out + m, an + bn - m, z1, mag_trim(z1, z1n));
+
+    free(sa); free(sb); free(z1);
+}
+
+// q = u / v, truncated, with room for m - n + 1 limbs. Requires m >= n and
+// v[n - 1] != 0. This is Knuth's algorithm D, normalizing v so that its top
+// limb has its high bit set.
+static
+void mag_div(const u32 *u, i32 m, const u32 *v, i32 n, u32 *q) {
+    if (n == 1) {
+        u64 k = 0;
+        for (i32 i = m - 1; i >= 0; i--) {
+            u64 cur = (k << 32) | u[i];
+            q[i] = (u32)(cur / v[0]);
+            k = cur % v[0];
+        }
+        return;
+    }
+
+    const u64 b = 1ULL << 32;
+    i32 s = __builtin_clz(v[n - 1]);
+    u32 *vn = malloc(sizeof(u32) * n);
+    u32 *un = malloc(sizeof(u32) * (m + 1));
+
+    for (i32 i = n - 1; i > 0; i--) {
+        vn[i] = (u32)(((u64)v[i] << s) | ((u64)v[i - 1] >> (32 - s)));
+    }
+    vn[0] = v[0] << s;
+
+    un[m] = (u32)((u64)u[m - 1] >> (32 - s));
+    for (i32 i = m - 1; i > 0; i--) {
+        un[i] = (u32)(((u64)u[i] << s) | ((u64)u[i - 1] >> (32 - s)));
+    }
+    un[0] = u[0] << s;
+
+    for (i32 j = m - n; j >= 0; j--) {
+        u64 num = ((u64)un[j + n] << 32) | un[j + n - 1];
+        u64 qhat = num / vn[n - 1];
+        u64 rhat = num % vn[n - 1];
+        while (qhat >= b || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >= b) break;
+        }
+
+        i64 k = 0, t;
+        for (i32 i = 0; i < n; i++) {
+            u64 p = qhat * vn[i];
+            t = (i64)un[i + j] - k - (i64)(p & 0xFFFFFFFFULL);
+            un[i + j] = (u32)t;
+            k = (i64)(p >> 32) - (t >> 32);
+        }
+        t = (i64)un[j + n] - k;
+        un[j + n] = (u32)t;
+
+        q[j] = (u32)qhat;
+        if (t < 0) {
+            // qhat was one too large, add v back.
+            q[j]--;
+            u64 carry = 0;
+            for (i32 i = 0; i < n; i++) {
+                carry += (u64)un[i + j] + vn[i];
+                un[i + j] = (u32)carry;
+                carry >>= 32;
+            }
+            un[j + n] += (u32)carry;
+        }
+    }
+
+    free(vn); free(un);
+}
+
+bignum* bn_from_i64(i64 x) {
+    u64 m = x < 0 ? (u64)(-(x + 1)) + 1 : (u64)x;
+    bignum *r = bn_alloc(2);
+    r->limbs[0] = (u32)m;
+    r->limbs[1] = (u32)(m >> 32);
+    r->neg = x < 0;
+    return bn_trim(r);
+}
+
+bignum* bn_from_str(const char *s) {
+    b8 neg = *s == '-';
+    if (neg || *s == '+') { s++; }
+    while (*s == '0') { s++; }
+
+    i32 digits = (i32)strlen(s);
+    bignum *r = bn_alloc(digits / 9 + 2);
+    r->len = 0;
+
+    // Feed 9 decimal digits at a time: r = r * 10^k + chunk.
+    i32 k = digits % 9 ? digits % 9 : 9;
+    while (*s) {
+        u32 chunk = 0, scale = 1;
+        for (i32 i = 0; i < k; i++) {
+            chunk = chunk * 10 + (u32)(*s++ - '0');
+            scale *= 10;
+        }
+
+        u64 carry = chunk;
+        for (i32 i = 0; i < r->len; i++) {
+            carry += (u64)r->limbs[i] * scale;
+            r->limbs[i] = (u32)carry;
+            carry >>= 32;
+        }
+        if (carry) { r->limbs[r->len++] = (u32)carry; }
+        k = 9;
+    }
+
+    r->neg = neg;
+    return bn_trim(r);
+}
+
+bignum* bn_copy(const bignum *x) {
+    bignum *r = bn_alloc(x->len);
+    r->neg = x->neg;
+    memcpy(r->limbs, x->limbs, sizeof(u32) * x->len);
+    return r;
+}
+
+void bn_free(bignum *x) {
+    free(x);
+}
+
+bignum* bn_neg(const bignum *x) {
+    bignum *r = bn_copy(x);
+    r->neg = x->len ? !x->neg : FALSE;
+    return r;
+}
+
+static
+bignum* bn_addsub(const bignum *x, const bignum *y, b8 yneg) {
+    i32 n = x->len > y->len ? x->len : y->len;
+    bignum *r = bn_alloc(n + 1);
+
+    if (x->neg == yneg) {
+        mag_add(x->limbs, x->len, y->limbs, y->len, r->limbs);
+        r->neg = x->neg;
+    } else if (mag_cmp(x->limbs, x->len, y->limbs, y->len) >= 0) {
+        mag_sub(x->limbs, x->len, y->limbs, y->len, r->limbs);
+        r->len = x->len;
+        r->neg = x->neg;
+    } else {
+        mag_sub(y->limbs, y->len, x->limbs, x->len, r->limbs);
+        r->len = y->len;
+        r->neg = yneg;
+    }
+    return bn_trim(r);
+}
+
+bignum* bn_add(const bignum *x, const bignum *y) {
+    return bn_addsub(x, y, y->neg);
+}
+
+bignum* bn_sub(const bignum *x, const bignum *y) {
+    return bn_addsub(x, y, y->len ? !y->neg : FALSE);
+}
+
+bignum* bn_mul(const bignum *x, const bignum *y) {
+    if (!x->len || !y->len) return bn_alloc(0);
+    bignum *r = bn_alloc(x->len + y->len);
+    mag_mul(x->limbs, x->len, y->limbs, y->len, r->limbs);
+    r->neg = x->neg != y->neg;
+    return bn_trim(r);
+}
+
+// Truncating division, like C's. The divisor must not be zero.
+bignum* bn_div(const bignum *x, const bignum *y) {
+    if (mag_cmp(x->limbs, x->len, y->limbs, y->len) < 0) return bn_alloc(0);
+    bignum *r = bn_alloc(x->len - y->len + 1);
+    mag_div(x->limbs, x->len, y->limbs, y->len, r->limbs);
+    r->neg = x->neg != y->neg;
+    return bn_trim(r);
+}
+
+b8 bn_is_zero(const bignum *x) {
+    return x->len == 0;
+}
+
+i32 bn_cmp(const bignum *x, const bignum *y) {
+    if (x->neg != y->neg) return x->neg ? -1 : 1;
+    i32 c = mag_cmp(x->limbs, x->len, y->limbs, y->len);
+    return x->neg ? -c : c;
+}
+
+b8 bn_to_i64(const bignum *x, i64 *out) {
+    if (x->len > 2) return FALSE;
+
+    u64 m = 0;
+    for (i32 i = x->len - 1; i >= 0; i--) { m = (m << 32) | x->limbs[i]; }
+
+    if (!x->neg) {
+        if (m > (u64)INT64_MAX) return FALSE;
+        *out = (i64)m;
+    } else {
+        if (m > (u64)INT64_MAX + 1) return FALSE;
+        *out = m == (u64)INT64_MAX + 1 ? INT64_MIN : -(i64)m;
+    }
+    return TRUE;
+}
+
+f64 bn_to_f64(const bignum *x) {
+    f64 d = 0;
+    for (i32 i = x->len - 1; i >= 0; i--) { d = d * 4294967296.0 + x->limbs[i]; }
+    return x->neg ? -d : d;
+}
+
+// Returns the decimal representation of `x`, to be freed by the caller.
+char* bn_to_str(const bignum *x) {
+    char *out = malloc((size_t)x->len * 10 + 3);
+    if (!x->len) {
+        strcpy(out, "0");
+        return out;
+    }
+
+    // Peel off 9 decimal digits at a time, least significant first.
+    u32 *m = malloc(sizeof(u32) * x->len);
+    u32 *chunks = malloc(sizeof(u32) * (x->len * 10 / 9 + 2));
+    memcpy(m, x->limbs, sizeof(u32) * x->len);
+
+    i32 n = x->len, count = 0;
+    while (n) {
+        u64 k = 0;
+        for (i32 i = n - 1; i >= 0; i--) {
+            u64 cur = (k << 32) | m[i];
+            m[i] = (u32)(cur / 1000000000);
+            k = cur % 1000000000;
+        }
+        chunks[count++] = (u32)k;
+        n = mag_trim(m, n);
+    }
+
+    char *p = out;
+    if (x->neg) { *p++ = '-'; }
+    p += sprintf(p, "%u", chunks[count - 1]);
+    for (i32 i = count - 2; i >= 0; i--) {
+        p += sprintf(p, "%09u", chunks[i]);
+    }
+
+    free(m); free(chunks);
+    return out;
+}
+
+u64 bn_hash(const bignum *x) {
+    u64 h = 14695981039346656037ULL ^ x->neg;
+    for (i32 i = 0; i < x->len; i++) {
+        h = (h ^ x->limbs[i]) * 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+// Arbitrary precision signed integer, stored as sign and magnitude with
+// little-endian 32-bit limbs and no leading zero limbs. Zero has len 0.
+// Values are immutable, every operation returns a new allocation.
+typedef struct bignum {
+    b8 neg;
+    i32 len;
+    u32 limbs[];
+} bignum;
+
+bignum* bn_from_i64(i64 x);
+bignum* bn_from_str(const char *s);
+bignum* bn_copy(const bignum *x);
+void bn_free(bignum *x);
+
+bignum* bn_neg(const bignum *x);
+bignum* bn_add(const bignum *x, const bignum *y);
+bignum* bn_sub(const bignum *x, const bignum *y);
+bignum* bn_mul(const bignum *x, const bignum *y);
+bignum* bn_div(const bignum *x, const bignum *y);
+
+b8 bn_is_zero(const bignum *x);
+i32 bn_cmp(const bignum *x, const bignum *y);
+b8 bn_to_i64(const bignum *x, i64 *out);
+f64 bn_to_f64(const bignum *x);
+char* bn_to_str(const bignum *x);
+u64 bn_hash(const bignum *x);
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "chan.h"
+
+#define LCHAN_LINE 64
+
+// Sequences count in twos: a slot is free for the send at position `pos`
+// when its sequence is 2*pos, and holds that send's value at 2*pos + 1.
+// Plain positions, as in the original, can't tell a full slot from a free
+// one a lap later when the channel holds a single value.
+typedef struct lchan_slot {
+    atomic_size_t seq;
+    lval *value;
+} lchan_slot;
+
+struct lchan {
+    // Senders and receivers each hammer their own counter, keep them on
+    // separate cache lines.
+    _Alignas(LCHAN_LINE) atomic_size_t send_pos;
+    _Alignas(LCHAN_LINE) atomic_size_t recv_pos;
+    _Alignas(LCHAN_LINE) atomic_int refs;
+    size_t cap;
+    lchan_slot *slots;
+};
+
+lchan* lchan_new(i64 cap) {
+    lchan *c = aligned_alloc(LCHAN_LINE, sizeof(lchan));
+    atomic_init(&c->send_pos, 0);
+    atomic_init(&c->recv_pos, 0);
+    atomic_init(&c->refs, 1);
+    c->cap = (size_t)cap;
+    c->slots = malloc(sizeof(lchan_slot) * c->cap);
+    for (size_t i = 0; i < c->cap; i++) {
+        atomic_init(&c->slots[i].seq, 2 * i);
+    }
+    return c;
+}
+
+lchan* lchan_share(lchan *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+    return c;
+}
+
+void lchan_release(lchan *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1) return;
+    lval *v;
+    while (lchan_try_recv(c, &v)) { lval_del(v); }
+    free(c->slots);
+    free(c);
+}
+
+i64 lchan_cap(const lchan *c) {
+    return (i64)c->cap;
+}
+
+i64 lchan_count(lchan *c) {
+    size_t sent = atomic_load(&c->send_pos);
+    size_t received = atomic_load(&c->recv_pos);
+    return (i64)(sent - received);
+}
+
+b8 lchan_try_send(lchan *c, lval *v) {
+    size_t pos = atomic_load_explicit(&c->send_pos, memory_order_relaxed);
+    for (;;) {
+        lchan_slot *s = &c->slots[pos % c->cap];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(2 * pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->send_pos, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                s->value = v;
+                atomic_store_explicit(&s->seq, 2 * pos + 1, memory_order_release);
+                return TRUE;
+            }
+        } else if (diff < 0) {
+            // The slot still holds the value sent a lap ago.
+            return FALSE;
+        } else {
+            pos = atomic_load_explicit(&c->send_pos, memory_order_relaxed);
+        }
+    }
+}
+
+b8 lchan_try_recv(lchan *c, lval **v) {
+    size_t pos = atomic_load_explicit(&c->recv_pos, memory_order_relaxed);
+    for (;;) {
+        lchan_slot *s = &c->slots[pos % c->cap];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(2 * pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->recv_pos, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                *v = s->value;
+                atomic_store_explicit(&s->seq, 2 * (pos + c->cap), memory_order_release);
+                return TRUE;
+            }
+        } else if (diff < 0) {
+            // Nothing sent into the slot yet.
+            return FALSE;
+        } else {
+            pos = atomic_load_explicit(&c->recv_pos, memory_order_relaxed);
+        }
+    }
+}
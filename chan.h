@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+#include "alisp.h"
+
+// Bounded multi-producer multi-consumer queue of lvals, after Dmitry
+// Vyukov's ring buffer: every slot carries a sequence number telling
+// senders and receivers whose turn it is, so each side claims a slot with
+// one compare-and-swap on its own counter and never takes a lock.
+//
+// Channels are reference counted and may be shared by any threads. The
+// values sent must not share anything that isn't thread safe with the
+// sender, the channel takes them over as they are.
+
+lchan* lchan_new(i64 cap);
+lchan* lchan_share(lchan *c);
+void lchan_release(lchan *c);
+i64 lchan_cap(const lchan *c);
+
+// Values sent and not yet received. Only a hint while others use `c`, a
+// send still being written counts already.
+i64 lchan_count(lchan *c);
+
+// Queues `v` and returns TRUE, taking ownership of it, or returns FALSE
+// when the channel is full.
+b8 lchan_try_send(lchan *c, lval *v);
+
+// Takes the oldest value into *v and returns TRUE, or returns FALSE when
+// the channel is empty.
+b8 lchan_try_recv(lchan *c, lval **v);
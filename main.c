@@ -1,91 +1,89 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #include <editline/readline.h>
 
 #include "mpc.h"
 #include "types.h"
 #include "alisp.h"
+#include "reader.h"
 
+// Evaluates the file at `path` form by form, printing what each form
+// evaluates to unless it's (). Stops at the first form that doesn't parse.
 static
-i32 __read_file_size(const char *filepath) {
-    struct stat stat_buf;
-    int rc = stat(filepath, &stat_buf);
-    return rc == 0 ? stat_buf.st_size : -1;
-}
-
-u32 io_read_file(const char* filepath, u8 **buf_ptr) {
-    FILE *file = fopen(filepath, "rb");
-
-    i32 filesize = __read_file_size(filepath);
-    if (filesize == -1) {
-        *buf_ptr = NULL;
-        return 0;
+i32 run_file(alisp_ctx *ctx, const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return 1;
     }
 
-    u8* buffer = (u8*)malloc(filesize + 1);
-    while (!feof(file)) {
-        fread(buffer, 1, filesize, file);
+    lstream *s = lstream_new(path, in);
+    lval *x;
+    while ((x = alisp_eval_next(ctx, s))) {
+        if (x->type != LVAL_SEXPR || x->count) { lval_println(x); }
+        lval_del(x);
     }
-    fclose(file);
-    buffer[filesize] = '\0';
-    *buf_ptr = buffer;
-    return filesize;
+    i32 status = 0;
+    if (alisp_ctx_error(ctx)) {
+        fputs(alisp_ctx_error(ctx), stderr);
+        status = 1;
+    }
+    lstream_del(s);
+    fclose(in);
+    return status;
 }
 
 i32 main(i32 argc, char** argv) {
-    if (argc > 1) {
-        if (!strcmp(argv[0], "--help")) {
-            puts("Usage: alisp <source-file>");
+    b8 use_mpc = FALSE;
+    const char *path = NULL;
+    for (i32 i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--hash-cons")) {
+            lval_set_hashcons(TRUE);
+        } else if (!strcmp(argv[i], "--mpc-reader")) {
+            use_mpc = TRUE;
+        } else if (!strcmp(argv[i], "--help")) {
+            puts("Usage: alisp [--hash-cons] [--mpc-reader] [source-file]");
             return 0;
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "alisp: unexpected argument '%s', see --help\n", argv[i]);
+            return 1;
         }
-
-        u8 source[512];
-        const char *filepath = argv[1];
-        u64 size = io_read_file(filepath, (u8 **)&source);
-        return 0;
     }
 
-    mpc_parser_t *Number   = mpc_new("number");
-    mpc_parser_t *Symbol   = mpc_new("symbol");
-    mpc_parser_t *Qexpr    = mpc_new("qexpr");
-    mpc_parser_t *Expr     = mpc_new("expr");
-    mpc_parser_t *Sexpr    = mpc_new("sexpr");
-    mpc_parser_t *Alisp    = mpc_new("alisp");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-            " number : /-?[0-9]+/ ;                                             "
-            " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                       "
-            " sexpr  : '(' <expr>* ')' ;                                        "
-            " qexpr  : '{' <expr>* '}' ;                                        "
-            " expr   : <number> | <symbol> | <sexpr> | <qexpr>;                 "
-            " alisp  : /^/ <expr>* /$/ ;                                        ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Alisp);
+    if (path) {
+        alisp_ctx *ctx = alisp_ctx_new();
+        alisp_ctx_use_mpc(ctx, use_mpc);
+        i32 status = run_file(ctx, path);
+        alisp_ctx_del(ctx);
+        return status;
+    }
 
     puts("Alisp Version 0.0.1");
 
-    lenv *env = lenv_new();
-    lenv_add_builtins(env);
+    alisp_ctx *ctx = alisp_ctx_new();
+    alisp_ctx_use_mpc(ctx, use_mpc);
     while (1) {
         char *input = readline("alisp> ");
+        if (!input) {
+            putchar('\n');
+            break;
+        }
         add_history(input);
 
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Alisp, &r)) {
-            lval *x = lval_eval(env, lval_read(r.output));
+        lval *x = alisp_eval(ctx, "<stdin>", input);
+        if (x) {
             lval_println(x);
             lval_del(x);
-
-            mpc_ast_delete(r.output);
         } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            fputs(alisp_ctx_error(ctx), stdout);
         }
         free(input);
     }
 
-    mpc_cleanup(6, Number, Symbol, Qexpr, Sexpr, Expr, Alisp);
+    alisp_ctx_del(ctx);
     return 0;
 }
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "map.h"
+
+#define LMAP_GROUP 16
+
+// Control bytes of slots without a key. Full slots hold 7 hash bits, so
+// the high bit tells the two apart.
+#define LMAP_EMPTY   ((u8)0x80)
+#define LMAP_DELETED ((u8)0xFE)
+
+struct lmap {
+    i32 refs;
+    i64 count;
+    i64 deleted;
+    i64 cap;        // slots, a power of two and a multiple of LMAP_GROUP
+    u8 *ctrl;
+    u64 *hashes;
+    lval **keys;
+    lval **vals;
+};
+
+// lval_hash mixes its inputs in, but numbers in a row still hash to
+// nearby values. The group index and control bits need all bits stirred.
+static _FORCE_INLINE_
+u64 lmap_hash(lval *k) {
+    u64 h = lval_hash(k);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static _FORCE_INLINE_
+u8 lmap_h2(u64 hash) {
+    return (u8)(hash & 0x7F);
+}
+
+// Bit i is set when control byte i of the group at `ctrl` is `b`.
+static _FORCE_INLINE_
+u32 lmap_match(const u8 *ctrl, u8 b) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+#else
+    u32 bits = 0;
+    for (i32 i = 0; i < LMAP_GROUP; i++) {
+        bits |= (u32)(ctrl[i] == b) << i;
+    }
+    return bits;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted.
+static _FORCE_INLINE_
+u32 lmap_match_free(const u8 *ctrl) {
+#ifdef __SSE2__
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    u32 bits = 0;
+    for (i32 i = 0; i < LMAP_GROUP; i++) {
+        bits |= (u32)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+static
+void lmap_alloc(lmap *m, i64 cap) {
+    m->cap = cap;
+    m->count = 0;
+    m->deleted = 0;
+    m->ctrl = malloc(cap);
+    memset(m->ctrl, LMAP_EMPTY, cap);
+    m->hashes = malloc(sizeof(u64) * cap);
+    m->keys = malloc(sizeof(lval *) * cap);
+    m->vals = malloc(sizeof(lval *) * cap);
+}
+
+lmap* lmap_new(void) {
+    lmap *m = malloc(sizeof(lmap));
+    m->refs = 1;
+    lmap_alloc(m, LMAP_GROUP);
+    return m;
+}
+
+lmap* lmap_share(lmap *m) {
+    m->refs++;
+    return m;
+}
+
+b8 lmap_shared(const lmap *m) {
+    return m->refs > 1;
+}
+
+void lmap_release(lmap *m) {
+    if (--m->refs) return;
+    for (i64 i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] & 0x80) continue;
+        lval_del(m->keys[i]);
+        lval_del(m->vals[i]);
+    }
+    free(m->ctrl); free(m->hashes); free(m->keys); free(m->vals);
+    free(m);
+}
+
+i64 lmap_count(const lmap *m) {
+    return m->count;
+}
+
+// Groups are probed quadratically: 1, 2, 3... groups further each time,
+// which visits every group when their number is a power of two.
+static
+i64 lmap_find(const lmap *m, lval *k, u64 hash) {
+    i64 mask = m->cap / LMAP_GROUP - 1;
+    i64 g = (i64)(hash >> 7) & mask;
+    u8 h2 = lmap_h2(hash);
+    for (i64 step = 1; ; step++) {
+        const u8 *ctrl = m->ctrl + g * LMAP_GROUP;
+        for (u32 bits = lmap_match(ctrl, h2); bits; bits &= bits - 1) {
+            i64 i = g * LMAP_GROUP + __builtin_ctz(bits);
+            if (m->hashes[i] == hash && lval_eq(m->keys[i], k)) return i;
+        }
+        if (lmap_match(ctrl, LMAP_EMPTY)) return -1;
+        g = (g + step) & mask;
+    }
+}
+
+// First free slot on the probe sequence of `hash`.
+static
+i64 lmap_slot(const lmap *m, u64 hash) {
+    i64 mask = m->cap / LMAP_GROUP - 1;
+    i64 g = (i64)(hash >> 7) & mask;
+    for (i64 step = 1; ; step++) {
+        u32 bits = lmap_match_free(m->ctrl + g * LMAP_GROUP);
+        if (bits) return g * LMAP_GROUP + __builtin_ctz(bits);
+        g = (g + step) & mask;
+    }
+}
+
+static
+void lmap_place(lmap *m, u64 hash, lval *k, lval *v) {
+    i64 i = lmap_slot(m, hash);
+    if (m->ctrl[i] == LMAP_DELETED) { m->deleted--; }
+    m->ctrl[i] = lmap_h2(hash);
+    m->hashes[i] = hash;
+    m->keys[i] = k;
+    m->vals[i] = v;
+    m->count++;
+}
+
+// Rebuilds the table without tombstones, at most half as loaded as allowed.
+static
+void lmap_grow(lmap *m) {
+    lmap old = *m;
+    i64 cap = old.cap;
+    while ((old.count + 1) * 16 > cap * 7) { cap *= 2; }
+    lmap_alloc(m, cap);
+    for (i64 i = 0; i < old.cap; i++) {
+        if (old.ctrl[i] & 0x80) continue;
+        lmap_place(m, old.hashes[i], old.keys[i], old.vals[i]);
+    }
+    free(old.ctrl); free(old.hashes); free(old.keys); free(old.vals);
+}
+
+lmap* lmap_copy(const lmap *m, lval* (*copy)(lval *)) {
+    lmap *c = malloc(sizeof(lmap));
+    c->refs = 1;
+    lmap_alloc(c, m->cap);
+    for (i64 i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] & 0x80) continue;
+        lmap_place(c, m->hashes[i], copy(m->keys[i]), copy(m->vals[i]));
+    }
+    return c;
+}
+
+lval* lmap_get(const lmap *m, lval *k) {
+    i64 i = lmap_find(m, k, lmap_hash(k));
+    return i < 0 ? NULL : m->vals[i];
+}
+
+void lmap_put(lmap *m, lval *k, lval *v) {
+    u64 hash = lmap_hash(k);
+    i64 i = lmap_find(m, k, hash);
+    if (i >= 0) {
+        lval_del(k);
+        lval_del(m->vals[i]);
+        m->vals[i] = v;
+        return;
+    }
+    if ((m->count + m->deleted + 1) * 8 > m->cap * 7) { lmap_grow(m); }
+    lmap_place(m, hash, k, v);
+}
+
+b8 lmap_remove(lmap *m, lval *k) {
+    i64 i = lmap_find(m, k, lmap_hash(k));
+    if (i < 0) return FALSE;
+    lval_del(m->keys[i]);
+    lval_del(m->vals[i]);
+
+    // A slot in a group that never filled up can't be in the way of a
+    // probe, so it goes straight back to empty.
+    const u8 *group = m->ctrl + (i & ~(i64)(LMAP_GROUP - 1));
+    if (lmap_match(group, LMAP_EMPTY)) {
+        m->ctrl[i] = LMAP_EMPTY;
+    } else {
+        m->ctrl[i] = LMAP_DELETED;
+        m->deleted++;
+    }
+    m->count--;
+    return TRUE;
+}
+
+void lmap_each(lmap *m, lval* (*fn)(lval *)) {
+    for (i64 i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] & 0x80) continue;
+        m->keys[i] = fn(m->keys[i]);
+        m->vals[i] = fn(m->vals[i]);
+    }
+}
+
+b8 lmap_next(const lmap *m, i64 *i, lval **k, lval **v) {
+    for (; *i < m->cap; (*i)++) {
+        if (m->ctrl[*i] & 0x80) continue;
+        *k = m->keys[*i];
+        *v = m->vals[*i];
+        (*i)++;
+        return TRUE;
+    }
+    return FALSE;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.h"
+#include "alisp.h"
+
+// Hash map from lval keys to lval values, laid out as a Swiss table: open
+// addressing over groups of 16 slots, each slot with one control byte
+// holding 7 bits of its key's hash. A lookup matches the control bytes of a
+// whole group at once and only compares the keys whose bits agree.
+//
+// Keys are hashed with lval_hash and compared with lval_eq. The map owns
+// its keys and values. Maps are reference counted, so copies of a map
+// value can share one table until one of them needs to change it.
+
+lmap* lmap_new(void);
+lmap* lmap_share(lmap *m);
+void lmap_release(lmap *m);
+b8 lmap_shared(const lmap *m);
+
+// A new map with the entries of `m`, copied through `copy`.
+lmap* lmap_copy(const lmap *m, lval* (*copy)(lval *));
+
+i64 lmap_count(const lmap *m);
+
+// The value stored under `k`, still owned by the map, or NULL.
+lval* lmap_get(const lmap *m, lval *k);
+
+// Stores `v` under `k`, taking ownership of both.
+void lmap_put(lmap *m, lval *k, lval *v);
+
+// Removes `k`, returning whether it was there.
+b8 lmap_remove(lmap *m, lval *k);
+
+// Replaces every key and value x with fn(x), which must keep keys equal.
+void lmap_each(lmap *m, lval* (*fn)(lval *));
+
+// Iterates over the entries: starting from *i = 0, each call gives the next
+// key and value and returns FALSE once there are none left.
+b8 lmap_next(const lmap *m, i64 *i, lval **k, lval **v);
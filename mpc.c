@@ -99,6 +99,10 @@ typedef struct {
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  size_t memo_num;
+  size_t memo_slots;
+  struct mpc_memo_t *memo;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -127,6 +131,10 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+
   return i;
 }
 
@@ -157,6 +165,10 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+
   return i;
 
 }
@@ -186,6 +198,10 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+
   return i;
 
 }
@@ -214,11 +230,18 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+
   return i;
 }
 
+static void mpc_memo_delete(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  mpc_memo_delete(i);
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
@@ -746,7 +769,7 @@ static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   strcpy(x->expected[x->expected_num-1], expected);
 }
 
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
+static mpc_err_t *mpc_err_join(mpc_input_t *i, mpc_err_t** x, int n) {
 
   int j, k, fst;
   mpc_err_t *e;
@@ -790,6 +813,14 @@ static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
     }
   }
 
+  return e;
+}
+
+static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
+
+  int j;
+  mpc_err_t *e = mpc_err_join(i, x, n);
+
   for (j = 0; j < n; j++) {
     if (x[j] == NULL) { continue; }
     mpc_err_delete_internal(i, x[j]);
@@ -879,6 +910,19 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+/* Like mpc_err_merge, but y is left alone */
+static mpc_err_t *mpc_err_merge_keep(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
+  mpc_err_t *e;
+  mpc_err_t *errs[2];
+  if (y == NULL) { return x; }
+  if (x != NULL && x->state.pos > y->state.pos) { return x; }
+  errs[0] = x;
+  errs[1] = y;
+  e = mpc_err_join(i, errs, 2);
+  mpc_err_delete_internal(i, x);
+  return e;
+}
+
 /*
 ** Parser Type
 */
@@ -967,6 +1011,7 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1066,7 +1111,9 @@ static mpc_result_t *mpc_grow_results(mpc_input_t *i, int j, mpc_result_t *resul
   return tmp_results;
 }
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1339,11 +1386,185 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Packrat Memo
+**
+** Rules of grammars built with MPCA_LANG_PACKRAT
+** remember the outcome of every attempt at an input
+** position, for the rest of the parse, so however much
+** the alternatives around them backtrack no rule runs
+** twice at the same place and parsing takes linear time.
+**
+** The outcome is the output AST, or the error, the
+** errors merged along the way and where the input was
+** left. The memo holds a reference to the AST and hands
+** out more, the AST functions copy a node before they
+** change it if it's shared, and once the parse is over
+** whatever is still shared in the result is copied, so
+** callers get a tree of their own. Folds run during the
+** parse should change ASTs only through those functions.
+**
+** It isn't free: every rule tried leaves an entry, with
+** copies of its errors. A grammar that never backtracks
+** parses about three times slower with the memo than
+** without (the flat list in bench/packrat).
+*/
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int mode;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_ast_t *output;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+} mpc_memo_t;
+
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a);
+
+static mpc_ast_t *mpc_memo_ast_share(mpc_ast_t *a) {
+  if (a != NULL) { a->refs++; }
+  return a;
+}
+
+/* Errors are kept in one block: the error, the expected list, the strings */
+static mpc_err_t *mpc_memo_err_copy(mpc_err_t *x) {
+  int j;
+  size_t n;
+  char *s;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  n = sizeof(mpc_err_t) + sizeof(char*) * x->expected_num + strlen(x->filename) + 1;
+  if (x->failure) { n += strlen(x->failure) + 1; }
+  for (j = 0; j < x->expected_num; j++) { n += strlen(x->expected[j]) + 1; }
+  y = malloc(n);
+  *y = *x;
+  y->expected = (char**)(y + 1);
+  s = (char*)(y->expected + x->expected_num);
+  y->filename = strcpy(s, x->filename);
+  s += strlen(s) + 1;
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = strcpy(s, x->failure);
+    s += strlen(s) + 1;
+  }
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = strcpy(s, x->expected[j]);
+    s += strlen(s) + 1;
+  }
+  return y;
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int mode) {
+  return ((size_t)p >> 4) * 31 + (size_t)pos * 2654435761u + (size_t)mode;
+}
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos, int mode) {
+  size_t j, mask;
+  if (i->memo_slots == 0) { return NULL; }
+  mask = i->memo_slots - 1;
+  for (j = mpc_memo_hash(p, pos, mode) & mask; i->memo[j].p; j = (j + 1) & mask) {
+    if (i->memo[j].p == p && i->memo[j].pos == pos && i->memo[j].mode == mode) {
+      return &i->memo[j];
+    }
+  }
+  return NULL;
+}
+
+static mpc_memo_t *mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos, int mode) {
+
+  size_t j, k, mask, slots;
+  mpc_memo_t *memo;
+
+  if (2 * (i->memo_num + 1) > i->memo_slots) {
+    slots = i->memo_slots ? 2 * i->memo_slots : 256;
+    memo = calloc(slots, sizeof(mpc_memo_t));
+    for (k = 0; k < i->memo_slots; k++) {
+      if (!i->memo[k].p) { continue; }
+      j = mpc_memo_hash(i->memo[k].p, i->memo[k].pos, i->memo[k].mode) & (slots - 1);
+      while (memo[j].p) { j = (j + 1) & (slots - 1); }
+      memo[j] = i->memo[k];
+    }
+    free(i->memo);
+    i->memo = memo;
+    i->memo_slots = slots;
+  }
+
+  mask = i->memo_slots - 1;
+  for (j = mpc_memo_hash(p, pos, mode) & mask; i->memo[j].p; j = (j + 1) & mask);
+  i->memo_num++;
+  i->memo[j].p = p;
+  i->memo[j].pos = pos;
+  i->memo[j].mode = mode;
+  return &i->memo[j];
+}
+
+static void mpc_memo_delete(mpc_input_t *i) {
+  size_t j;
+  for (j = 0; j < i->memo_slots; j++) {
+    if (!i->memo[j].p) { continue; }
+    if (i->memo[j].output) { mpc_ast_delete(i->memo[j].output); }
+    free(i->memo[j].error);
+    free(i->memo[j].merged);
+  }
+  free(i->memo);
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+}
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  int x;
+  mpc_err_t *merged = NULL;
+  long pos = i->state.pos;
+  /* Suppressed errors aren't made, without backtracking failures don't rewind */
+  int mode = (i->suppress > 0) | (i->backtrack > 0) << 1;
+  mpc_memo_t *m = mpc_memo_find(i, p, pos, mode);
+
+  if (m == NULL) {
+    x = mpc_parse_step(i, p, r, &merged, depth);
+    m = mpc_memo_add(i, p, pos, mode);
+    m->success = x;
+    m->state = i->state;
+    m->last = i->last;
+    m->output = x ? mpc_memo_ast_share(r->output) : NULL;
+    m->error = x ? NULL : mpc_memo_err_copy(r->error);
+    m->merged = mpc_memo_err_copy(merged);
+    mpc_err_delete_internal(i, merged);
+    *e = mpc_err_merge_keep(i, *e, m->merged);
+    return x;
+  }
+
+  i->state = m->state;
+  i->last = m->last;
+  *e = mpc_err_merge_keep(i, *e, m->merged);
+  if (m->success) {
+    r->output = mpc_memo_ast_share(m->output);
+  } else {
+    r->error = mpc_err_join(i, &m->error, 1);
+  }
+  return m->success;
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  if (p->memo && i->type == MPC_INPUT_STRING) {
+    return mpc_parse_memo(i, p, r, e, depth);
+  }
+  return mpc_parse_step(i, p, r, e, depth);
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e, 0);
+  if (x && i->memo) {
+    mpc_memo_delete(i);
+    r->output = p->memo ? mpc_ast_unshare(r->output) : r->output;
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -2940,6 +3161,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
 
   if (a == NULL) { return; }
+  if (--a->refs > 0) { return; }
 
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2973,10 +3195,41 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->children_num = 0;
   a->children = NULL;
+  a->refs = 1;
   return a;
 
 }
 
+/* A node of one's own to change: shared ones are copied, their children shared */
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL || a->refs == 1) { return a; }
+
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = a->children[i];
+    b->children[i]->refs++;
+  }
+  a->refs--;
+  return b;
+}
+
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+  int i;
+  a = mpc_ast_own(a);
+  if (a == NULL) { return a; }
+  for (i = 0; i < a->children_num; i++) {
+    a->children[i] = mpc_ast_unshare(a->children[i]);
+  }
+  return a;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -3024,6 +3277,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  r = mpc_ast_own(r);
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -3032,6 +3286,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -3041,6 +3296,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -3048,6 +3304,7 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3055,6 +3312,7 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->state = s;
   return a;
 }
@@ -3277,6 +3535,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   for (i = 0; i < n; i++) {
 
     if (as[i] == NULL) { continue; }
+    if (as[i]->children_num > 0) { as[i] = mpc_ast_own(as[i]); }
 
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
@@ -3715,6 +3974,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_PACKRAT) { left->memo = 1; }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// Tasks left to a worker, the range [top, bottom).
+typedef struct pool_deque {
+    pthread_mutex_t lock;
+    i64 top;
+    i64 bottom;
+} pool_deque;
+
+// A task queued with pool_submit.
+typedef struct pool_task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct pool_task *next;
+} pool_task;
+
+typedef struct pool_worker {
+    pool *pool;
+    i32 index;
+    pthread_t thread;
+} pool_worker;
+
+struct pool {
+    i32 size;
+    pool_worker *workers;
+    pool_deque *deques;     // one per worker, the last for the job's caller
+
+    pthread_mutex_t run;    // held by the thread whose job is running
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // a job was posted, or the pool is shutting down
+    pthread_cond_t done;    // the job's last task or worker is through
+    const pool_job *job;    // NULL once the job is done
+    u64 generation;         // counts posted jobs
+    atomic_llong pending;   // tasks of the job not done yet
+    i32 active;             // workers that joined the job and aren't through
+    pool_task *head;        // submitted tasks, oldest first
+    pool_task *tail;
+    i32 idle;               // workers waiting for something to do
+    i32 spares;             // spare threads running
+    b8 spare_starting;
+    b8 quit;
+};
+
+static _Thread_local b8 pool_worker_thread = FALSE;
+
+static
+b8 pool_take(pool *p, i32 w, i64 *task) {
+    for (i32 k = 0; k <= p->size; k++) {
+        pool_deque *d = &p->deques[(w + k) % (p->size + 1)];
+        pthread_mutex_lock(&d->lock);
+        b8 ok = d->top < d->bottom;
+        if (ok) { *task = k == 0 ? d->top++ : --d->bottom; }
+        pthread_mutex_unlock(&d->lock);
+        if (ok) return TRUE;
+    }
+    return FALSE;
+}
+
+// Runs tasks of `job` as worker `w` until there are none left to take.
+static
+void pool_work(pool *p, const pool_job *job, i32 w) {
+    if (job->setup) { job->setup(job->ctx, w); }
+    i64 task;
+    while (pool_take(p, w, &task)) {
+        job->task(job->ctx, w, task);
+        if (atomic_fetch_sub(&p->pending, 1) == 1) {
+            pthread_mutex_lock(&p->lock);
+            pthread_cond_broadcast(&p->done);
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    if (job->teardown) { job->teardown(job->ctx, w); }
+}
+
+static
+void* pool_main(void *arg) {
+    pool_worker *self = arg;
+    pool *p = self->pool;
+    pool_worker_thread = TRUE;
+
+    u64 seen = 0;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->generation == seen && !p->head) {
+            p->idle++;
+            pthread_cond_wait(&p->wake, &p->lock);
+            p->idle--;
+        }
+        if (p->generation == seen) {
+            // No job to join, run a submitted task if there's one left.
+            pool_task *t = p->head;
+            if (!t) break;
+            p->head = t->next;
+            if (!p->head) { p->tail = NULL; }
+            pthread_mutex_unlock(&p->lock);
+            t->fn(t->arg);
+            free(t);
+            pthread_mutex_lock(&p->lock);
+            continue;
+        }
+        seen = p->generation;
+        // A worker that was busy with a submitted task may find the job
+        // done without it.
+        const pool_job *job = p->job;
+        if (!job) continue;
+        p->active++;
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p, job, self->index);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->active == 0) { pthread_cond_broadcast(&p->done); }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static
+void* pool_spare(void *arg) {
+    pool *p = arg;
+    pool_worker_thread = TRUE;
+
+    pthread_mutex_lock(&p->lock);
+    p->spare_starting = FALSE;
+    pool_task *t;
+    while ((t = p->head)) {
+        p->head = t->next;
+        if (!p->head) { p->tail = NULL; }
+        pthread_mutex_unlock(&p->lock);
+        t->fn(t->arg);
+        free(t);
+        pthread_mutex_lock(&p->lock);
+    }
+    if (--p->spares == 0) { pthread_cond_broadcast(&p->done); }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+pool* pool_new(i32 threads) {
+    if (threads <= 0) { threads = (i32)sysconf(_SC_NPROCESSORS_ONLN); }
+    if (threads <= 0) { threads = 1; }
+
+    pool *p = calloc(1, sizeof(pool));
+    p->size = threads;
+    p->workers = calloc(threads, sizeof(pool_worker));
+    p->deques = calloc(threads + 1, sizeof(pool_deque));
+    pthread_mutex_init(&p->run, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (i32 i = 0; i <= threads; i++) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+    for (i32 i = 0; i < threads; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        pthread_create(&p->workers[i].thread, NULL, pool_main, &p->workers[i]);
+    }
+    return p;
+}
+
+void pool_del(pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = TRUE;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i32 i = 0; i < p->size; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+    for (i32 i = 0; i <= p->size; i++) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->spares) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_destroy(&p->run);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->workers); free(p->deques); free(p);
+}
+
+i32 pool_size(pool *p) {
+    return p->size + 1;
+}
+
+b8 pool_in_worker(void) {
+    return pool_worker_thread;
+}
+
+void pool_submit(pool *p, void (*fn)(void *arg), void *arg) {
+    pool_task *t = malloc(sizeof(pool_task));
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->tail) { p->tail->next = t; } else { p->head = t; }
+    p->tail = t;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_blocked(pool *p) {
+    pthread_mutex_lock(&p->lock);
+    // One spare at a time: it takes a task before another one is needed.
+    if (p->head && !p->idle && !p->spare_starting) {
+        pthread_t thread;
+        p->spare_starting = TRUE;
+        p->spares++;
+        if (pthread_create(&thread, NULL, pool_spare, p) == 0) {
+            pthread_detach(thread);
+        } else {
+            p->spare_starting = FALSE;
+            p->spares--;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+b8 pool_run(pool *p, const pool_job *job, i64 count) {
+    if (pool_worker_thread) return FALSE;
+
+    pthread_mutex_lock(&p->run);
+    pthread_mutex_lock(&p->lock);
+    i32 n = p->size + 1;
+    for (i32 i = 0; i < n; i++) {
+        p->deques[i].top = count * i / n;
+        p->deques[i].bottom = count * (i + 1) / n;
+    }
+    p->job = job;
+    atomic_store(&p->pending, count);
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    // Workers running submitted tasks may not get to the job at all, the
+    // caller takes their share. It counts as a worker meanwhile, so jobs
+    // its tasks post don't wait on the one it's running.
+    pool_worker_thread = TRUE;
+    pool_work(p, job, p->size);
+    pool_worker_thread = FALSE;
+
+    pthread_mutex_lock(&p->lock);
+    while (atomic_load(&p->pending) || p->active) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    p->job = NULL;
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->run);
+    return TRUE;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+
+// Work-stealing thread pool for data-parallel jobs. A job is `count` tasks
+// identified by index, split in contiguous ranges over the workers' deques.
+// The thread running the job is a worker too, the last one. A worker takes
+// tasks from the front of its own range and, when it runs dry, steals from
+// the back of the others. Single tasks can be submitted too, to be run by
+// whichever worker is free first.
+
+typedef struct pool pool;
+
+typedef struct pool_job {
+    // Called by every worker before it takes any task, and after the last.
+    void (*setup)(void *ctx, i32 worker);
+    void (*teardown)(void *ctx, i32 worker);
+    void (*task)(void *ctx, i32 worker, i64 index);
+    void *ctx;
+} pool_job;
+
+// Starts `threads` workers, or one per online CPU when it is 0.
+pool* pool_new(i32 threads);
+void pool_del(pool *p);
+
+// Number of workers a job can run on: the threads, and the caller.
+i32 pool_size(pool *p);
+
+// Runs all tasks of `job` and returns once they are done, taking tasks on
+// the calling thread too. Threads busy with a submitted task join the job
+// when they're through, if it isn't done by then. Jobs posted from several
+// threads run one after the other. Jobs don't nest: a worker calling it
+// gets FALSE back and has to run the tasks itself.
+b8 pool_run(pool *p, const pool_job *job, i64 count);
+
+// Queues fn(arg) to run once on some worker, independently of jobs.
+// Workers pick tasks up oldest first whenever they aren't busy with a job,
+// and finish the queue before pool_del lets them go.
+void pool_submit(pool *p, void (*fn)(void *arg), void *arg);
+
+// Tells the pool the calling thread waits on something submitted tasks may
+// provide. When tasks are queued and no worker is free for them, a spare
+// thread is started to run them, which quits once the queue is empty.
+void pool_blocked(pool *p);
+
+// Whether the calling thread is a pool worker, or runs tasks of a job.
+b8 pool_in_worker(void);
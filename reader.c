@@ -0,0 +1,610 @@
+// madvise for mapped source files.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "reader.h"
+#include "bignum.h"
+
+#define LREAD_SYM   1
+#define LREAD_DIGIT 2
+#define LREAD_SPACE 4
+
+// Character classes of the grammar, by byte.
+#define S LREAD_SYM
+#define D LREAD_DIGIT
+#define W LREAD_SPACE
+static const u8 lread_class[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   W,   W,   W,   W,   W,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      W,   S,   0,   0,   0,   0,   S,   0,   0,   0,   S,   S,   0,   S,   0,   S,
+    S|D, S|D, S|D, S|D, S|D, S|D, S|D, S|D, S|D, S|D,   0,   0,   S,   S,   S,   0,
+      0,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,
+      S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   0,   S,   0,   0,   S,
+      0,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,
+      S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   S,   0,   0,   0,   0,   0,
+};
+#undef S
+#undef D
+#undef W
+
+// Tokens up to this long are copied to the stack to be NUL terminated.
+#define LREAD_BUF 256
+
+// Bytes are classified this many at a time, a bit each, and runs of a
+// class are then skipped a whole token at once by counting bits.
+#define LREAD_BLOCK 64
+
+typedef struct lread_block {
+    const char *at;     // first of the bytes classified, NULL for none yet
+    u64 space;
+    u64 sym;
+    u64 digit;
+} lread_block;
+
+typedef struct lreader {
+    const char *filename;
+    const char *src;
+    const char *end;
+    i64 line;       // where `src` is in the file
+    i64 col;
+    char *error;
+    lread_block block;
+} lreader;
+
+static
+void lread_fail(lreader *r, const char *at, const char *msg) {
+    i64 line = r->line, col = r->col;
+    for (const char *c = r->src; c < at; c++) {
+        if (*c == '\n') { line++; col = 1; } else { col++; }
+    }
+    const char *fmt = "%s:%lli:%lli: error: %s\n";
+    i32 n = snprintf(NULL, 0, fmt, r->filename, line, col, msg);
+    r->error = malloc(n + 1);
+    snprintf(r->error, n + 1, fmt, r->filename, line, col, msg);
+}
+
+static _FORCE_INLINE_
+b8 lread_is(const char *p, const char *end, u8 class) {
+    return p < end && (lread_class[(u8)*p] & class);
+}
+
+#ifdef __SSE2__
+// Lanes of `v` between lo and lo + n.
+static _FORCE_INLINE_
+__m128i lread_range(__m128i v, char lo, char n) {
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(n)), d);
+}
+#endif
+
+// Classifies the bytes from `p`, up to LREAD_BLOCK of them. The bits of
+// those past `end` are left clear. Agrees with lread_class.
+static
+void lread_classify(lread_block *b, const char *p, const char *end) {
+    b->at = p;
+    b->space = b->sym = b->digit = 0;
+#ifdef __SSE2__
+    if (end - p >= LREAD_BLOCK) {
+        static const char punct[] = "!&*+-/<=>\\_";
+        for (i32 i = 0; i < LREAD_BLOCK; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i digit = lread_range(v, '0', 9);
+            __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                         lread_range(v, '\t', '\r' - '\t'));
+            __m128i alpha = lread_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z' - 'a');
+            __m128i sym = _mm_or_si128(digit, alpha);
+            for (i32 j = 0; j < (i32)sizeof(punct) - 1; j++) {
+                sym = _mm_or_si128(sym, _mm_cmpeq_epi8(v, _mm_set1_epi8(punct[j])));
+            }
+            b->space |= (u64)(u16)_mm_movemask_epi8(space) << i;
+            b->sym |= (u64)(u16)_mm_movemask_epi8(sym) << i;
+            b->digit |= (u64)(u16)_mm_movemask_epi8(digit) << i;
+        }
+        return;
+    }
+#endif
+    i64 n = end - p < LREAD_BLOCK ? end - p : LREAD_BLOCK;
+    for (i64 i = 0; i < n; i++) {
+        u8 c = lread_class[(u8)p[i]];
+        b->space |= (u64)((c & LREAD_SPACE) != 0) << i;
+        b->sym |= (u64)((c & LREAD_SYM) != 0) << i;
+        b->digit |= (u64)((c & LREAD_DIGIT) != 0) << i;
+    }
+}
+
+// End of the run of bytes of `class` starting at `p`.
+static _FORCE_INLINE_
+const char* lread_span(lreader *r, const char *p, u8 class) {
+    for (;;) {
+        lread_block *b = &r->block;
+        if (!b->at || p < b->at || p >= b->at + LREAD_BLOCK) {
+            if (p >= r->end) return p;
+            lread_classify(b, p, r->end);
+        }
+        u64 bits = class == LREAD_SPACE ? b->space : class == LREAD_SYM ? b->sym : b->digit;
+        u64 rest = ~bits >> (p - b->at);
+        if (rest) return p + __builtin_ctzll(rest);
+        p = b->at + LREAD_BLOCK;
+    }
+}
+
+// First byte from `p` that is a bracket or a quote, or in a string, a
+// quote or a backslash. `end` if there's none.
+static
+const char* lread_find(const char *p, const char *end, b8 str) {
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        if (str) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        } else {
+            m = _mm_or_si128(m, lread_range(v, '(', 1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+        }
+        u32 bits = (u32)_mm_movemask_epi8(m);
+        if (bits) return p + __builtin_ctz(bits);
+    }
+#endif
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '"') return p;
+        if (str ? c == '\\' : c == '(' || c == ')' || c == '{' || c == '}') return p;
+    }
+    return end;
+}
+
+// End of the number starting at `p`, or NULL if there's none. Like the
+// grammar's regex, the fraction and the exponent are only taken whole.
+static
+const char* lread_number_end(lreader *r, const char *p, b8 *flt) {
+    const char *end = r->end;
+    if (p < end && *p == '-') p++;
+    if (!lread_is(p, end, LREAD_DIGIT)) return NULL;
+    p = lread_span(r, p, LREAD_DIGIT);
+
+    *flt = FALSE;
+    if (p < end && *p == '.' && lread_is(p + 1, end, LREAD_DIGIT)) {
+        p = lread_span(r, p + 1, LREAD_DIGIT);
+        *flt = TRUE;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        if (q < end && (*q == '-' || *q == '+')) q++;
+        if (lread_is(q, end, LREAD_DIGIT)) {
+            p = lread_span(r, q, LREAD_DIGIT);
+            *flt = TRUE;
+        }
+    }
+    return p;
+}
+
+// Copies [p, end) to `buf`, or to the heap when it doesn't fit, NUL
+// terminated.
+static
+char* lread_cstr(const char *p, const char *end, char *buf) {
+    i64 n = end - p;
+    char *s = n < LREAD_BUF ? buf : malloc(n + 1);
+    memcpy(s, p, n);
+    s[n] = '\0';
+    return s;
+}
+
+// The value of the eight digits in `w`, loaded little-endian, converted in
+// three multiplies over the whole word: pairs of digits first, then pairs
+// of pairs. Leading bytes that are zero count as zeros.
+static _FORCE_INLINE_
+u64 lread_digits8(u64 w) {
+    w = (w & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+    w = (w & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+    return (w & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
+}
+
+b8 lread_int(const char *p, const char *end, i64 *out) {
+    b8 neg = *p == '-';
+    p += neg;
+    i64 n = end - p;
+    while (n > 19 && *p == '0') { p++; n--; }
+    // 19 digits always fit in a u64, so only the sign's range is left.
+    if (n > 19) return FALSE;
+
+    u64 v = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (n >= 8) {
+        static const u64 scale[8] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+        i64 rest = n & 7;
+        u64 w;
+        for (; p < end - rest; p += 8) {
+            memcpy(&w, p, 8);
+            v = v * 100000000 + lread_digits8(w);
+        }
+        // The digits that don't make a whole word: the word ending with
+        // them is loaded and the digits before them are cleared.
+        if (rest) {
+            memcpy(&w, end - 8, 8);
+            v = v * scale[rest] + lread_digits8(w & (~0ULL << 8 * (8 - rest)));
+            p = end;
+        }
+    }
+#endif
+    for (; p < end; p++) { v = v * 10 + (u64)(*p - '0'); }
+    if (v > (u64)INT64_MAX + neg) return FALSE;
+    *out = neg && v ? -(i64)(v - 1) - 1 : (i64)v;
+    return TRUE;
+}
+
+static
+lval* lread_number(const char *p, const char *end, b8 flt) {
+    char buf[LREAD_BUF];
+    if (flt) {
+        char *s = lread_cstr(p, end, buf);
+        errno = 0;
+        f64 v = strtod(s, NULL);
+        if (s != buf) { free(s); }
+        if (errno == ERANGE && isinf(v)) return lval_err("invalid_number");
+        return lval_flt(v);
+    }
+
+    i64 v;
+    if (lread_int(p, end, &v)) return lval_num(v);
+    char *s = lread_cstr(p, end, buf);
+    lval *x = lval_big(bn_from_str(s));
+    if (s != buf) { free(s); }
+    return x;
+}
+
+// Reads the string whose opening quote is at `*p`, leaving `*p` past the
+// closing one. Escapes are the C ones, others stay as they are written.
+static
+lval* lread_string(lreader *r, const char **p) {
+    const char *start = *p + 1, *q = start;
+    for (;;) {
+        q = lread_find(q, r->end, TRUE);
+        if (q == r->end || *q == '"') break;
+        q += q + 1 < r->end ? 2 : 1;
+    }
+    if (q >= r->end) {
+        lread_fail(r, *p, "unterminated string");
+        return NULL;
+    }
+    *p = q + 1;
+
+    char buf[LREAD_BUF];
+    char *s = q - start < LREAD_BUF ? buf : malloc(q - start);
+    i64 n = 0;
+    for (const char *c = start; c < q; c++) {
+        // Up to the next escape, or the end, nothing changes.
+        const char *e = lread_find(c, q, TRUE);
+        memcpy(s + n, c, e - c);
+        n += e - c;
+        c = e;
+        if (c == q) break;
+        if (*c == '\\' && c + 1 < q) {
+            char e = 0;
+            switch (c[1]) {
+                case 'a': e = '\a'; break;
+                case 'b': e = '\b'; break;
+                case 'f': e = '\f'; break;
+                case 'n': e = '\n'; break;
+                case 'r': e = '\r'; break;
+                case 't': e = '\t'; break;
+                case 'v': e = '\v'; break;
+                case '\\': case '\'': case '"': e = c[1]; break;
+                case '0': e = '\0'; break;
+                default: s[n++] = *c; continue;
+            }
+            s[n++] = e;
+            c++;
+            continue;
+        }
+        s[n++] = *c;
+    }
+    lval *x = lval_str(s, n);
+    if (s != buf) { free(s); }
+    return x;
+}
+
+static
+lval* lread_all(lreader *in) {
+    lreader r = *in;
+
+    // Lists still open, outermost first, and the bracket closing each.
+    i32 depth = 0, cap = 16;
+    lval **open = malloc(sizeof(lval *) * cap);
+    char *close = malloc(cap);
+    lval *cur = lval_sexpr();
+
+    const char *p = r.src;
+    while (!r.error) {
+        p = lread_span(&r, p, LREAD_SPACE);
+        if (p == r.end) break;
+
+        char c = *p;
+        if (c == '(' || c == '{') {
+            if (depth == cap) {
+                cap *= 2;
+                open = realloc(open, sizeof(lval *) * cap);
+                close = realloc(close, cap);
+            }
+            open[depth] = cur;
+            close[depth] = c == '(' ? ')' : '}';
+            depth++;
+            cur = c == '(' ? lval_sexpr() : lval_qexpr();
+            p++;
+            continue;
+        }
+        if (c == ')' || c == '}') {
+            if (!depth || close[depth - 1] != c) {
+                lread_fail(&r, p, depth ? "mismatched bracket" : "unexpected closing bracket");
+                break;
+            }
+            lval *x = lval_hcons(cur);
+            cur = lval_add(open[--depth], x);
+            p++;
+            continue;
+        }
+        if (c == '"') {
+            lval *x = lread_string(&r, &p);
+            if (x) { lval_add(cur, x); }
+            continue;
+        }
+
+        b8 flt;
+        const char *q = lread_number_end(&r, p, &flt);
+        if (q) {
+            lval_add(cur, lread_number(p, q, flt));
+            p = q;
+            continue;
+        }
+        if (lread_is(p, r.end, LREAD_SYM)) {
+            q = lread_span(&r, p, LREAD_SYM);
+            lval_add(cur, lval_sym_n(p, q - p));
+            p = q;
+            continue;
+        }
+        lread_fail(&r, p, "unexpected character");
+    }
+    if (!r.error && depth) {
+        lread_fail(&r, p, close[depth - 1] == ')' ? "missing ')'" : "missing '}'");
+    }
+
+    if (r.error) {
+        lval_del(cur);
+        while (depth) { lval_del(open[--depth]); }
+        cur = NULL;
+    } else {
+        cur = lval_hcons(cur);
+    }
+    free(open);
+    free(close);
+    in->error = r.error;
+    return cur;
+}
+
+lval* lread(const char *filename, const char *src, i64 len, char **error) {
+    lreader r = { filename, src, src + len, 1, 1, NULL, { 0 } };
+    lval *x = lread_all(&r);
+    *error = r.error;
+    return x;
+}
+
+// Input is read in chunks of this size. The buffer only grows past it for
+// a form that doesn't fit.
+#define LSTREAM_CHUNK (64 * 1024)
+
+// A mapped file gives back the pages it's done with every this many bytes.
+#define LSTREAM_DROP (4 * 1024 * 1024)
+
+struct lstream {
+    const char *filename;
+    FILE *in;
+    b8 eof;
+    b8 mapped;      // `buf` is the whole file mapped, not a copy of it
+    i64 dropped;    // mapped bytes before this were given back
+    char *buf;
+    i64 cap;
+    i64 len;        // bytes in `buf`
+    i64 pos;        // start of the next form
+    i64 line;       // where `pos` is in the file
+    i64 col;
+    lval *pending;  // forms read but not returned yet
+};
+
+// Regular files read from the start are mapped instead, the reader then
+// works on the page cache directly with nothing copied. Pipes and the
+// like are read in chunks.
+static
+b8 lstream_map(lstream *s) {
+    struct stat st;
+    if (fstat(fileno(s->in), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return FALSE;
+    if (ftell(s->in) != 0) return FALSE;
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(s->in), 0);
+    if (m == MAP_FAILED) return FALSE;
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+    s->buf = m;
+    s->cap = s->len = st.st_size;
+    s->eof = TRUE;
+    s->mapped = TRUE;
+    return TRUE;
+}
+
+lstream* lstream_new(const char *filename, FILE *in) {
+    lstream *s = calloc(1, sizeof(lstream));
+    s->filename = filename;
+    s->in = in;
+    if (!lstream_map(s)) {
+        s->cap = LSTREAM_CHUNK;
+        s->buf = malloc(s->cap);
+    }
+    s->line = 1;
+    s->col = 1;
+    return s;
+}
+
+void lstream_del(lstream *s) {
+    if (s->pending) { lval_del(s->pending); }
+    if (s->mapped) {
+        munmap(s->buf, s->cap);
+    } else {
+        free(s->buf);
+    }
+    free(s);
+}
+
+// Gives the pages of a mapped file that were read back to the kernel, so
+// that a large file doesn't stay resident as it is read through.
+static
+void lstream_drop(lstream *s) {
+    if (!s->mapped || s->pos - s->dropped < LSTREAM_DROP) return;
+    i64 page = sysconf(_SC_PAGESIZE);
+    i64 to = s->pos / page * page;
+    madvise(s->buf + s->dropped, to - s->dropped, MADV_DONTNEED);
+    s->dropped = to;
+}
+
+// Drops what was consumed before `pos` and reads another chunk after what
+// is left. Returns FALSE at the end of the input.
+static
+b8 lstream_fill(lstream *s) {
+    if (s->eof) return FALSE;
+    memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+    if (s->cap - s->len < LSTREAM_CHUNK) {
+        s->cap = s->len + LSTREAM_CHUNK;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    size_t n = fread(s->buf + s->len, 1, LSTREAM_CHUNK, s->in);
+    s->len += n;
+    if (n < LSTREAM_CHUNK) { s->eof = TRUE; }
+    return n > 0;
+}
+
+static
+void lstream_advance(lstream *s, i64 to) {
+    for (i64 i = s->pos; i < to; i++) {
+        if (s->buf[i] == '\n') { s->line++; s->col = 1; } else { s->col++; }
+    }
+    s->pos = to;
+}
+
+// Reads more input when `*i` reached the end of what is buffered, keeping
+// it at the same byte. Returns FALSE at the end of the input.
+static
+b8 lstream_more(lstream *s, i64 *i) {
+    i64 off = *i - s->pos;
+    if (!lstream_fill(s)) return FALSE;
+    *i = s->pos + off;
+    return TRUE;
+}
+
+// Length of the top-level form at `pos`: a bracketed list or a string
+// with all it contains, or else a run of atoms up to the next delimiter.
+// Reads more input until the form ends or the input does.
+static
+i64 lstream_extent(lstream *s) {
+    i64 i = s->pos, depth = 0;
+    b8 str = FALSE, atom = FALSE;
+    for (;; i++) {
+        if (str || depth) {
+            // Inside, only brackets and quotes matter, or in a string,
+            // quotes and escapes.
+            while ((i = lread_find(s->buf + i, s->buf + s->len, str) - s->buf) == s->len) {
+                if (!lstream_more(s, &i)) return i - s->pos;
+            }
+        } else if (i == s->len && !lstream_more(s, &i)) {
+            return i - s->pos;
+        }
+        char c = s->buf[i];
+        if (str) {
+            if (c == '\\') {
+                if (i + 1 == s->len && !lstream_more(s, &i)) return i + 1 - s->pos;
+                i++;
+            } else if (c == '"') {
+                str = FALSE;
+                if (!depth) return i + 1 - s->pos;
+            }
+            continue;
+        }
+        b8 delim = (lread_class[(u8)c] & LREAD_SPACE)
+                || c == '(' || c == ')' || c == '{' || c == '}' || c == '"';
+        if (atom) {
+            if (delim) return i - s->pos;
+            continue;
+        }
+        if (c == '"') {
+            str = TRUE;
+        } else if (c == '(' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == '}') {
+            if (depth <= 1) return i + 1 - s->pos;
+            depth--;
+        } else if (!depth && !delim) {
+            atom = TRUE;
+        }
+    }
+}
+
+const char* lstream_filename(lstream *s) {
+    return s->filename;
+}
+
+const char* lstream_next(lstream *s, i64 *len, i64 *line, i64 *col) {
+    lstream_drop(s);
+    i64 i = s->pos;
+    for (;;) {
+        if (i == s->len) {
+            lstream_advance(s, i);
+            if (!lstream_fill(s)) return NULL;
+            i = s->pos;
+        }
+        if (!(lread_class[(u8)s->buf[i]] & LREAD_SPACE)) break;
+        i++;
+    }
+    lstream_advance(s, i);
+
+    *len = lstream_extent(s);
+    *line = s->line;
+    *col = s->col;
+    const char *form = s->buf + s->pos;
+    lstream_advance(s, s->pos + *len);
+    return form;
+}
+
+lval* lstream_read(lstream *s, char **error) {
+    *error = NULL;
+    for (;;) {
+        if (s->pending && s->pending->count) {
+            lval *x = s->pending->cell[0];
+            memmove(&s->pending->cell[0], &s->pending->cell[1],
+                    sizeof(lval *) * (s->pending->count - 1));
+            s->pending->count--;
+            return x;
+        }
+
+        i64 n, line, col;
+        const char *form = lstream_next(s, &n, &line, &col);
+        if (!form) return NULL;
+        lreader r = { s->filename, form, form + n, line, col, NULL, { 0 } };
+        lval *forms = lread_all(&r);
+        if (!forms) {
+            *error = r.error;
+            return NULL;
+        }
+        if (s->pending) { lval_del(s->pending); }
+        s->pending = forms;
+    }
+}
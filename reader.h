@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "types.h"
+#include "alisp.h"
+
+// Hand-written reader for the alisp grammar. It makes one pass over the
+// bytes and builds the values as it goes, with no parse tree in between.
+// It accepts exactly what the mpc grammar in alisp.c does, which is kept
+// as the reference.
+
+// Reads the `len` bytes at `src` as a sequence of expressions and returns
+// them in an S-expression. On malformed input returns NULL and sets *error
+// to a message starting with `filename`, line and column, which the caller
+// frees.
+lval* lread(const char *filename, const char *src, i64 len, char **error);
+
+// Parses the integer spelled in [p, end), digits after an optional '-',
+// in place. Returns FALSE when it doesn't fit in an i64.
+b8 lread_int(const char *p, const char *end, i64 *out);
+
+// Reads a file one top-level form at a time, keeping only the form being
+// read in memory, so input of any size starts evaluating right away.
+lstream* lstream_new(const char *filename, FILE *in);
+void lstream_del(lstream *s);
+
+// The next top-level form, or NULL at the end of the input or, with
+// *error set as by lread, when the form is malformed.
+lval* lstream_read(lstream *s, char **error);
+
+// The text of the next top-level form, for reading it with another parser
+// instead, and where it starts in the file. The `*len` bytes stay valid
+// until the next call. Returns NULL at the end of the input.
+const char* lstream_next(lstream *s, i64 *len, i64 *line, i64 *col);
+const char* lstream_filename(lstream *s);
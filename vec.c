@@ -0,0 +1,540 @@
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "vec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+// Element i of an operand, broadcasting when `v` is FALSE.
+#define VEC_AT(p, v, i) ((p)[(v) ? (i) : 0])
+
+// Float sums and products keep this many interleaved partial results.
+#define VEC_LANES 4
+
+typedef struct vec_impl {
+    void (*f64_arith)(i32, const f64*, b8, const f64*, b8, f64*, i64);
+    b8   (*i64_arith)(i32, const i64*, b8, const i64*, b8, i64*, i64);
+    void (*f64_cmp)(i32, const f64*, b8, const f64*, b8, i64*, i64);
+    void (*i64_cmp)(i32, const i64*, b8, const i64*, b8, i64*, i64);
+    f64  (*f64_reduce)(const f64*, i64, b8);
+    b8   (*i64_sum)(const i64*, i64, i64*);
+    f64  (*f64_minmax)(const f64*, i64, b8);
+    i64  (*i64_minmax)(const i64*, i64, b8);
+} vec_impl;
+
+static
+void f64_arith_c(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, f64 *out, i64 n) {
+    for (i64 i = 0; i < n; i++) {
+        f64 a = VEC_AT(x, xv, i), b = VEC_AT(y, yv, i);
+        switch (op) {
+            case VEC_ADD: out[i] = a + b; break;
+            case VEC_SUB: out[i] = a - b; break;
+            case VEC_MUL: out[i] = a * b; break;
+            default:      out[i] = a / b; break;
+        }
+    }
+}
+
+static
+b8 i64_arith_c(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    for (i64 i = 0; i < n; i++) {
+        i64 a = VEC_AT(x, xv, i), b = VEC_AT(y, yv, i);
+        switch (op) {
+            case VEC_ADD: if (__builtin_add_overflow(a, b, &out[i])) return FALSE; break;
+            case VEC_SUB: if (__builtin_sub_overflow(a, b, &out[i])) return FALSE; break;
+            case VEC_MUL: if (__builtin_mul_overflow(a, b, &out[i])) return FALSE; break;
+            default:
+                if (b == 0 || (a == INT64_MIN && b == -1)) return FALSE;
+                out[i] = a / b;
+                break;
+        }
+    }
+    return TRUE;
+}
+
+static
+void f64_cmp_c(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, i64 *out, i64 n) {
+    for (i64 i = 0; i < n; i++) {
+        f64 a = VEC_AT(x, xv, i), b = VEC_AT(y, yv, i);
+        switch (op) {
+            case VEC_LT: out[i] = a <  b; break;
+            case VEC_GT: out[i] = a >  b; break;
+            case VEC_LE: out[i] = a <= b; break;
+            case VEC_GE: out[i] = a >= b; break;
+            case VEC_EQ: out[i] = a == b; break;
+            default:     out[i] = a != b; break;
+        }
+    }
+}
+
+static
+void i64_cmp_c(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    for (i64 i = 0; i < n; i++) {
+        i64 a = VEC_AT(x, xv, i), b = VEC_AT(y, yv, i);
+        switch (op) {
+            case VEC_LT: out[i] = a <  b; break;
+            case VEC_GT: out[i] = a >  b; break;
+            case VEC_LE: out[i] = a <= b; break;
+            case VEC_GE: out[i] = a >= b; break;
+            case VEC_EQ: out[i] = a == b; break;
+            default:     out[i] = a != b; break;
+        }
+    }
+}
+
+// Folds the tail `x` into the partial results `s` and combines them.
+// Lane i % VEC_LANES takes x[i], the same as in the SIMD kernels.
+static
+f64 f64_lanes_c(const f64 *x, i64 n, b8 mul, f64 *s) {
+    for (i64 i = 0; i < n; i++) {
+        if (mul) { s[i % VEC_LANES] *= x[i]; } else { s[i % VEC_LANES] += x[i]; }
+    }
+    return mul ? (s[0] * s[1]) * (s[2] * s[3]) : (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+static
+f64 f64_reduce_c(const f64 *x, i64 n, b8 mul) {
+    f64 z = mul ? 1.0 : 0.0;
+    f64 s[VEC_LANES] = { z, z, z, z };
+    return f64_lanes_c(x, n, mul, s);
+}
+
+static
+b8 i64_sum_c(const i64 *x, i64 n, i64 *out) {
+    i64 s = 0;
+    for (i64 i = 0; i < n; i++) {
+        if (__builtin_add_overflow(s, x[i], &s)) return FALSE;
+    }
+    *out = s;
+    return TRUE;
+}
+
+static
+f64 f64_minmax_c(const f64 *x, i64 n, b8 max) {
+    f64 m = x[0];
+    for (i64 i = 0; i < n; i++) {
+        if (x[i] != x[i]) return x[i];
+        if (max ? x[i] > m : x[i] < m) { m = x[i]; }
+    }
+    return m;
+}
+
+static
+i64 i64_minmax_c(const i64 *x, i64 n, b8 max) {
+    i64 m = x[0];
+    for (i64 i = 1; i < n; i++) {
+        if (max ? x[i] > m : x[i] < m) { m = x[i]; }
+    }
+    return m;
+}
+
+#ifdef VEC_X86
+
+// The SIMD kernels handle whole registers and leave the tail to the C ones.
+
+__attribute__((target("avx2")))
+static
+void f64_arith_avx2(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, f64 *out, i64 n) {
+    __m256d xb = _mm256_set1_pd(x[0]), yb = _mm256_set1_pd(y[0]);
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d a = xv ? _mm256_loadu_pd(x + i) : xb;
+        __m256d b = yv ? _mm256_loadu_pd(y + i) : yb;
+        __m256d r;
+        switch (op) {
+            case VEC_ADD: r = _mm256_add_pd(a, b); break;
+            case VEC_SUB: r = _mm256_sub_pd(a, b); break;
+            case VEC_MUL: r = _mm256_mul_pd(a, b); break;
+            default:      r = _mm256_div_pd(a, b); break;
+        }
+        _mm256_storeu_pd(out + i, r);
+    }
+    f64_arith_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+// Only + and - have 64-bit lanes in AVX2, an overflow shows up in the sign
+// bit of (a ^ r) & (b ^ r) for + and (a ^ b) & (a ^ r) for -.
+__attribute__((target("avx2")))
+static
+b8 i64_arith_avx2(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    if (op != VEC_ADD && op != VEC_SUB) return i64_arith_c(op, x, xv, y, yv, out, n);
+
+    __m256i xb = _mm256_set1_epi64x(x[0]), yb = _mm256_set1_epi64x(y[0]);
+    __m256i bad = _mm256_setzero_si256();
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = xv ? _mm256_loadu_si256((const __m256i *)(x + i)) : xb;
+        __m256i b = yv ? _mm256_loadu_si256((const __m256i *)(y + i)) : yb;
+        __m256i r;
+        if (op == VEC_ADD) {
+            r = _mm256_add_epi64(a, b);
+            bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_xor_si256(a, r), _mm256_xor_si256(b, r)));
+        } else {
+            r = _mm256_sub_epi64(a, b);
+            bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(a, r)));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), r);
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(bad))) return FALSE;
+    return i64_arith_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+void f64_cmp_avx2(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, i64 *out, i64 n) {
+    __m256d xb = _mm256_set1_pd(x[0]), yb = _mm256_set1_pd(y[0]);
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d a = xv ? _mm256_loadu_pd(x + i) : xb;
+        __m256d b = yv ? _mm256_loadu_pd(y + i) : yb;
+        __m256d m;
+        switch (op) {
+            case VEC_LT: m = _mm256_cmp_pd(a, b, _CMP_LT_OQ);  break;
+            case VEC_GT: m = _mm256_cmp_pd(a, b, _CMP_GT_OQ);  break;
+            case VEC_LE: m = _mm256_cmp_pd(a, b, _CMP_LE_OQ);  break;
+            case VEC_GE: m = _mm256_cmp_pd(a, b, _CMP_GE_OQ);  break;
+            case VEC_EQ: m = _mm256_cmp_pd(a, b, _CMP_EQ_OQ);  break;
+            default:     m = _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); break;
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_srli_epi64(_mm256_castpd_si256(m), 63));
+    }
+    f64_cmp_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+void i64_cmp_avx2(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    __m256i xb = _mm256_set1_epi64x(x[0]), yb = _mm256_set1_epi64x(y[0]);
+    __m256i ones = _mm256_set1_epi64x(-1);
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = xv ? _mm256_loadu_si256((const __m256i *)(x + i)) : xb;
+        __m256i b = yv ? _mm256_loadu_si256((const __m256i *)(y + i)) : yb;
+        __m256i m;
+        switch (op) {
+            case VEC_LT: m = _mm256_cmpgt_epi64(b, a); break;
+            case VEC_GT: m = _mm256_cmpgt_epi64(a, b); break;
+            case VEC_LE: m = _mm256_xor_si256(_mm256_cmpgt_epi64(a, b), ones); break;
+            case VEC_GE: m = _mm256_xor_si256(_mm256_cmpgt_epi64(b, a), ones); break;
+            case VEC_EQ: m = _mm256_cmpeq_epi64(a, b); break;
+            default:     m = _mm256_xor_si256(_mm256_cmpeq_epi64(a, b), ones); break;
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_srli_epi64(m, 63));
+    }
+    i64_cmp_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static
+f64 f64_reduce_avx2(const f64 *x, i64 n, b8 mul) {
+    __m256d acc = _mm256_set1_pd(mul ? 1.0 : 0.0);
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d a = _mm256_loadu_pd(x + i);
+        acc = mul ? _mm256_mul_pd(acc, a) : _mm256_add_pd(acc, a);
+    }
+    f64 s[VEC_LANES];
+    _mm256_storeu_pd(s, acc);
+    return f64_lanes_c(x + i, n - i, mul, s);
+}
+
+__attribute__((target("avx2")))
+static
+b8 i64_sum_avx2(const i64 *x, i64 n, i64 *out) {
+    __m256i acc = _mm256_setzero_si256(), bad = _mm256_setzero_si256();
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i r = _mm256_add_epi64(acc, a);
+        bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_xor_si256(acc, r), _mm256_xor_si256(a, r)));
+        acc = r;
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(bad))) return FALSE;
+
+    i64 s[5];
+    _mm256_storeu_si256((__m256i *)s, acc);
+    return i64_sum_c(x + i, n - i, &s[4]) && i64_sum_c(s, 5, out);
+}
+
+__attribute__((target("avx2")))
+static
+f64 f64_minmax_avx2(const f64 *x, i64 n, b8 max) {
+    __m256d m = _mm256_set1_pd(x[0]), nan = _mm256_setzero_pd();
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d a = _mm256_loadu_pd(x + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(a, a, _CMP_UNORD_Q));
+        m = max ? _mm256_max_pd(m, a) : _mm256_min_pd(m, a);
+    }
+    if (_mm256_movemask_pd(nan)) return NAN;
+
+    f64 s[5];
+    _mm256_storeu_pd(s, m);
+    s[4] = i < n ? f64_minmax_c(x + i, n - i, max) : s[0];
+    return f64_minmax_c(s, 5, max);
+}
+
+__attribute__((target("avx2")))
+static
+i64 i64_minmax_avx2(const i64 *x, i64 n, b8 max) {
+    __m256i m = _mm256_set1_epi64x(x[0]);
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i take = max ? _mm256_cmpgt_epi64(a, m) : _mm256_cmpgt_epi64(m, a);
+        m = _mm256_blendv_epi8(m, a, take);
+    }
+
+    i64 s[5];
+    _mm256_storeu_si256((__m256i *)s, m);
+    s[4] = i < n ? i64_minmax_c(x + i, n - i, max) : s[0];
+    return i64_minmax_c(s, 5, max);
+}
+
+__attribute__((target("sse4.2")))
+static
+void f64_arith_sse(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, f64 *out, i64 n) {
+    __m128d xb = _mm_set1_pd(x[0]), yb = _mm_set1_pd(y[0]);
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d a = xv ? _mm_loadu_pd(x + i) : xb;
+        __m128d b = yv ? _mm_loadu_pd(y + i) : yb;
+        __m128d r;
+        switch (op) {
+            case VEC_ADD: r = _mm_add_pd(a, b); break;
+            case VEC_SUB: r = _mm_sub_pd(a, b); break;
+            case VEC_MUL: r = _mm_mul_pd(a, b); break;
+            default:      r = _mm_div_pd(a, b); break;
+        }
+        _mm_storeu_pd(out + i, r);
+    }
+    f64_arith_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static
+b8 i64_arith_sse(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    if (op != VEC_ADD && op != VEC_SUB) return i64_arith_c(op, x, xv, y, yv, out, n);
+
+    __m128i xb = _mm_set1_epi64x(x[0]), yb = _mm_set1_epi64x(y[0]);
+    __m128i bad = _mm_setzero_si128();
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = xv ? _mm_loadu_si128((const __m128i *)(x + i)) : xb;
+        __m128i b = yv ? _mm_loadu_si128((const __m128i *)(y + i)) : yb;
+        __m128i r;
+        if (op == VEC_ADD) {
+            r = _mm_add_epi64(a, b);
+            bad = _mm_or_si128(bad, _mm_and_si128(_mm_xor_si128(a, r), _mm_xor_si128(b, r)));
+        } else {
+            r = _mm_sub_epi64(a, b);
+            bad = _mm_or_si128(bad, _mm_and_si128(_mm_xor_si128(a, b), _mm_xor_si128(a, r)));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), r);
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(bad))) return FALSE;
+    return i64_arith_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static
+void f64_cmp_sse(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, i64 *out, i64 n) {
+    __m128d xb = _mm_set1_pd(x[0]), yb = _mm_set1_pd(y[0]);
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d a = xv ? _mm_loadu_pd(x + i) : xb;
+        __m128d b = yv ? _mm_loadu_pd(y + i) : yb;
+        __m128d m;
+        switch (op) {
+            case VEC_LT: m = _mm_cmplt_pd(a, b);  break;
+            case VEC_GT: m = _mm_cmpgt_pd(a, b);  break;
+            case VEC_LE: m = _mm_cmple_pd(a, b);  break;
+            case VEC_GE: m = _mm_cmpge_pd(a, b);  break;
+            case VEC_EQ: m = _mm_cmpeq_pd(a, b);  break;
+            default:     m = _mm_cmpneq_pd(a, b); break;
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_srli_epi64(_mm_castpd_si128(m), 63));
+    }
+    f64_cmp_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static
+void i64_cmp_sse(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    __m128i xb = _mm_set1_epi64x(x[0]), yb = _mm_set1_epi64x(y[0]);
+    __m128i ones = _mm_set1_epi64x(-1);
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = xv ? _mm_loadu_si128((const __m128i *)(x + i)) : xb;
+        __m128i b = yv ? _mm_loadu_si128((const __m128i *)(y + i)) : yb;
+        __m128i m;
+        switch (op) {
+            case VEC_LT: m = _mm_cmpgt_epi64(b, a); break;
+            case VEC_GT: m = _mm_cmpgt_epi64(a, b); break;
+            case VEC_LE: m = _mm_xor_si128(_mm_cmpgt_epi64(a, b), ones); break;
+            case VEC_GE: m = _mm_xor_si128(_mm_cmpgt_epi64(b, a), ones); break;
+            case VEC_EQ: m = _mm_cmpeq_epi64(a, b); break;
+            default:     m = _mm_xor_si128(_mm_cmpeq_epi64(a, b), ones); break;
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_srli_epi64(m, 63));
+    }
+    i64_cmp_c(op, x + (xv ? i : 0), xv, y + (yv ? i : 0), yv, out + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static
+f64 f64_reduce_sse(const f64 *x, i64 n, b8 mul) {
+    __m128d lo = _mm_set1_pd(mul ? 1.0 : 0.0), hi = lo;
+    i64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+        lo = mul ? _mm_mul_pd(lo, a) : _mm_add_pd(lo, a);
+        hi = mul ? _mm_mul_pd(hi, b) : _mm_add_pd(hi, b);
+    }
+    f64 s[VEC_LANES];
+    _mm_storeu_pd(s, lo);
+    _mm_storeu_pd(s + 2, hi);
+    return f64_lanes_c(x + i, n - i, mul, s);
+}
+
+__attribute__((target("sse4.2")))
+static
+b8 i64_sum_sse(const i64 *x, i64 n, i64 *out) {
+    __m128i acc = _mm_setzero_si128(), bad = _mm_setzero_si128();
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i r = _mm_add_epi64(acc, a);
+        bad = _mm_or_si128(bad, _mm_and_si128(_mm_xor_si128(acc, r), _mm_xor_si128(a, r)));
+        acc = r;
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(bad))) return FALSE;
+
+    i64 s[3];
+    _mm_storeu_si128((__m128i *)s, acc);
+    return i64_sum_c(x + i, n - i, &s[2]) && i64_sum_c(s, 3, out);
+}
+
+__attribute__((target("sse4.2")))
+static
+f64 f64_minmax_sse(const f64 *x, i64 n, b8 max) {
+    __m128d m = _mm_set1_pd(x[0]), nan = _mm_setzero_pd();
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d a = _mm_loadu_pd(x + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(a, a));
+        m = max ? _mm_max_pd(m, a) : _mm_min_pd(m, a);
+    }
+    if (_mm_movemask_pd(nan)) return NAN;
+
+    f64 s[3];
+    _mm_storeu_pd(s, m);
+    s[2] = i < n ? f64_minmax_c(x + i, n - i, max) : s[0];
+    return f64_minmax_c(s, 3, max);
+}
+
+__attribute__((target("sse4.2")))
+static
+i64 i64_minmax_sse(const i64 *x, i64 n, b8 max) {
+    __m128i m = _mm_set1_epi64x(x[0]);
+    i64 i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i take = max ? _mm_cmpgt_epi64(a, m) : _mm_cmpgt_epi64(m, a);
+        m = _mm_blendv_epi8(m, a, take);
+    }
+
+    i64 s[3];
+    _mm_storeu_si128((__m128i *)s, m);
+    s[2] = i < n ? i64_minmax_c(x + i, n - i, max) : s[0];
+    return i64_minmax_c(s, 3, max);
+}
+
+#endif
+
+static const vec_impl vec_c = {
+    f64_arith_c, i64_arith_c, f64_cmp_c, i64_cmp_c,
+    f64_reduce_c, i64_sum_c, f64_minmax_c, i64_minmax_c
+};
+
+#ifdef VEC_X86
+static const vec_impl vec_avx2 = {
+    f64_arith_avx2, i64_arith_avx2, f64_cmp_avx2, i64_cmp_avx2,
+    f64_reduce_avx2, i64_sum_avx2, f64_minmax_avx2, i64_minmax_avx2
+};
+
+static const vec_impl vec_sse = {
+    f64_arith_sse, i64_arith_sse, f64_cmp_sse, i64_cmp_sse,
+    f64_reduce_sse, i64_sum_sse, f64_minmax_sse, i64_minmax_sse
+};
+#endif
+
+static const vec_impl *vec = &vec_c;
+
+static pthread_once_t vec_once = PTHREAD_ONCE_INIT;
+
+static
+void vec_select(void) {
+#ifdef VEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vec = &vec_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        vec = &vec_sse;
+    }
+#endif
+}
+
+void vec_init(void) {
+    pthread_once(&vec_once, vec_select);
+}
+
+void vec_f64_arith(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, f64 *out, i64 n) {
+    if (n > 0) { vec->f64_arith(op, x, xv, y, yv, out, n); }
+}
+
+b8 vec_i64_arith(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    return n > 0 ? vec->i64_arith(op, x, xv, y, yv, out, n) : TRUE;
+}
+
+void vec_f64_cmp(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, i64 *out, i64 n) {
+    if (n > 0) { vec->f64_cmp(op, x, xv, y, yv, out, n); }
+}
+
+void vec_i64_cmp(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n) {
+    if (n > 0) { vec->i64_cmp(op, x, xv, y, yv, out, n); }
+}
+
+f64 vec_f64_sum(const f64 *x, i64 n) {
+    return vec->f64_reduce(x, n, FALSE);
+}
+
+f64 vec_f64_prod(const f64 *x, i64 n) {
+    return vec->f64_reduce(x, n, TRUE);
+}
+
+b8 vec_i64_sum(const i64 *x, i64 n, i64 *out) {
+    return vec->i64_sum(x, n, out);
+}
+
+// There is no packed 64-bit multiply to speak of below AVX-512.
+b8 vec_i64_prod(const i64 *x, i64 n, i64 *out) {
+    i64 p = 1;
+    for (i64 i = 0; i < n; i++) {
+        if (__builtin_mul_overflow(p, x[i], &p)) return FALSE;
+    }
+    *out = p;
+    return TRUE;
+}
+
+f64 vec_f64_minmax(const f64 *x, i64 n, b8 max) {
+    return vec->f64_minmax(x, n, max);
+}
+
+i64 vec_i64_minmax(const i64 *x, i64 n, b8 max) {
+    return vec->i64_minmax(x, n, max);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+
+// Element-wise kernels over packed i64 and f64 arrays. The implementation
+// (AVX2, SSE4.2 or plain C) is picked by vec_init from the running CPU.
+//
+// All kernels compute out[i] = x[i] op y[i] for i < n. When `xv` (or `yv`)
+// is FALSE, x[0] (or y[0]) is used for every i, so a scalar operand is
+// broadcast without being expanded into an array.
+
+enum {
+    VEC_ADD,
+    VEC_SUB,
+    VEC_MUL,
+    VEC_DIV,
+
+    VEC_LT,
+    VEC_GT,
+    VEC_LE,
+    VEC_GE,
+    VEC_EQ,
+    VEC_NE
+};
+
+void vec_init(void);
+
+void vec_f64_arith(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, f64 *out, i64 n);
+
+// Returns FALSE on overflow, division by zero or INT64_MIN / -1, in which
+// case `out` holds partial results.
+b8 vec_i64_arith(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n);
+
+// Comparisons write 1 where the relation holds and 0 elsewhere.
+void vec_f64_cmp(i32 op, const f64 *x, b8 xv, const f64 *y, b8 yv, i64 *out, i64 n);
+void vec_i64_cmp(i32 op, const i64 *x, b8 xv, const i64 *y, b8 yv, i64 *out, i64 n);
+
+// Reductions. Float sums and products are accumulated in four interleaved
+// partial results by every implementation, so they round the same on any
+// CPU. Integer reductions return FALSE when a partial result overflows,
+// for the caller to redo exactly. min and max need n > 0 and return NaN
+// when any element is NaN.
+f64 vec_f64_sum(const f64 *x, i64 n);
+f64 vec_f64_prod(const f64 *x, i64 n);
+b8 vec_i64_sum(const i64 *x, i64 n, i64 *out);
+b8 vec_i64_prod(const i64 *x, i64 n, i64 *out);
+f64 vec_f64_minmax(const f64 *x, i64 n, b8 max);
+i64 vec_i64_minmax(const i64 *x, i64 n, b8 max);